@@ -0,0 +1,58 @@
+/*
+ * Batched creation of small output files.
+ *
+ * SPDX-FileCopyrightText: 2026 SombrAbsol
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef FILEBATCH_H
+#define FILEBATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Largest file worth queuing in a batch. Larger files spend their time moving
+ * data rather than in per-file system calls, and are written on their own.
+ */
+#define FILE_BATCH_MAX_SIZE 0x10000
+
+typedef struct FileBatch FileBatch;
+
+/*
+ * Create a batch of files to write into an existing directory. On Linux, the
+ * queued files are opened, written and closed through io_uring, a few system
+ * calls for a whole batch; elsewhere, or if the kernel cannot open files into
+ * io_uring direct descriptors (before 5.15), they are written one by one with
+ * write_file. acftool only uses batches when asked to with --io-uring.
+ */
+FileBatch *file_batch_create(const char *dir);
+
+/*
+ * Return room for 'size' bytes of file data that stays valid until the next
+ * flush, flushing the batch first if it is full. Return NULL if size exceeds
+ * FILE_BATCH_MAX_SIZE.
+ */
+uint8_t *file_batch_buffer(FileBatch *b, size_t size);
+
+/*
+ * Queue a file of the directory. Neither the name nor the data are needed
+ * after the next flush, which happens here when the queue is full; the data
+ * is not copied.
+ */
+void file_batch_add(FileBatch *b, const char *name, const uint8_t *data,
+                    size_t size);
+
+/*
+ * Write every queued file. Files that cannot be written are reported on
+ * stderr, and make this or the next flush return EXIT_FAILURE.
+ */
+int file_batch_flush(FileBatch *b);
+
+/*
+ * Flush and free a batch.
+ */
+void file_batch_destroy(FileBatch *b);
+
+#endif /* FILEBATCH_H */
@@ -12,16 +12,198 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+/*
+ * Compression levels accepted by lz10_compress_level. Each level is at least
+ * as slow as the one below it and aims to be at least as small. Levels 1-5 use
+ * a greedy search with an increasingly deep match finder, 6-8 also try lazy
+ * and near-optimal parses and keep the smallest, and 9 is the optimal parse.
+ */
+#define LZ10_LEVEL_MIN 1
+#define LZ10_LEVEL_DEFAULT 5
+#define LZ10_LEVEL_MAX 9
+
+/*
+ * Number of leading bytes encoded by lz10_estimate_size.
+ */
+#define LZ10_SAMPLE_SIZE 0x10000
+
 /*
  * Decompress an LZ10 buffer.
  */
 uint8_t *lz10_decompress(const uint8_t *src, size_t srcSize, size_t *outSize);
 
+/*
+ * Check that an LZ10 buffer decodes cleanly, without writing any output, and
+ * store its decompressed size in outSize. Accept exactly what lz10_decompress
+ * accepts, at a fraction of the cost. Return 0 on success; nothing is printed
+ * on failure.
+ */
+int lz10_validate(const uint8_t *src, size_t srcSize, size_t *outSize);
+
+/*
+ * Return the decompressed size declared by an LZ10 header, without decoding
+ * anything, or 0 if src does not start with a valid LZ10 header.
+ */
+size_t lz10_peek_size(const uint8_t *src, size_t srcSize);
+
+/*
+ * Decode only the first n bytes of an LZ10 buffer into dst, or all of it if
+ * shorter, and store their count in outSize. Decoding stops there, so looking
+ * at the magic of a large entry costs next to nothing. Return 0 on success,
+ * or -1 without printing anything if the data does not decode.
+ */
+int lz10_decompress_prefix(const uint8_t *src, size_t srcSize, uint8_t *dst,
+                           size_t n, size_t *outSize);
+
+/*
+ * Decompress an LZ10 buffer into dst, which must hold at least the size
+ * declared by the header (see lz10_peek_size). Nothing is allocated, so dst
+ * can be a reused scratch buffer or a mapped output file. Return 0 on success.
+ */
+int lz10_decompress_into(const uint8_t *src, size_t srcSize, uint8_t *dst,
+                         size_t dstCap, size_t *outSize);
+
 /*
  * Compress a buffer using an LZ10 encoder. Use a greedy longest-match search
  * within a sliding window of up to 0x1000 bytes, with a maximum match length
- * of 0x12 bytes.
+ * of 0x12 bytes. Candidates are found through hash chains keyed on 3-byte
+ * prefixes. Equivalent to lz10_compress_level with LZ10_LEVEL_DEFAULT.
  */
 uint8_t *lz10_compress(const uint8_t *src, size_t srcSize, size_t *outSize);
 
+/*
+ * Compress a buffer using the search strategy of the given level, from
+ * LZ10_LEVEL_MIN (fastest) to LZ10_LEVEL_MAX (smallest output).
+ */
+uint8_t *lz10_compress_level(const uint8_t *src, size_t srcSize, int level,
+                             size_t *outSize);
+
+/*
+ * Compress a buffer into the smallest possible LZ10 stream, using an optimal
+ * parse over every match candidate instead of a greedy search. Slower and
+ * uses about 11 bytes of working memory per input byte.
+ */
+uint8_t *lz10_compress_optimal(const uint8_t *src, size_t srcSize,
+                               size_t *outSize);
+
+/*
+ * Compress a buffer like lz10_compress_level, splitting inputs larger than
+ * 512 KiB into chunks encoded on up to numThreads threads. Each chunk can
+ * still reference the 0x1000 bytes preceding it. The chunking does not depend
+ * on numThreads, so neither does the output.
+ */
+uint8_t *lz10_compress_mt(const uint8_t *src, size_t srcSize, int level,
+                          unsigned numThreads, size_t *outSize);
+
+/*
+ * Reusable compressor context. It keeps its output buffer and search tables
+ * across calls, growing them as needed, so that compressing many inputs does
+ * not allocate for each one.
+ */
+typedef struct LZ10Compressor LZ10Compressor;
+
+/*
+ * Create a compressor context for the given level, able to encode large inputs
+ * on up to numThreads threads.
+ */
+LZ10Compressor *lz10_compressor_create(int level, unsigned numThreads);
+
+/*
+ * Compress a buffer with a context, splitting inputs larger than 512 KiB into
+ * chunks like lz10_compress_mt. The returned buffer belongs to the context and
+ * stays valid until the next call or until the context is destroyed.
+ */
+const uint8_t *lz10_compressor_compress(LZ10Compressor *c, const uint8_t *src,
+                                        size_t srcSize, size_t *outSize);
+
+/*
+ * Release a compressor context and every buffer it owns.
+ */
+void lz10_compressor_destroy(LZ10Compressor *c);
+
+/*
+ * Output callback of the incremental encoder and decoder. Return 0 on
+ * success.
+ */
+typedef int (*LZ10Sink)(void *user, const uint8_t *data, size_t size);
+
+/*
+ * Incremental encoder. It takes its input in pieces of any size and only keeps
+ * the 0x1000-byte window plus one 512 KiB chunk per thread, whatever the total
+ * input size. Its output is identical to lz10_compress_mt at the same level.
+ */
+typedef struct LZ10Encoder LZ10Encoder;
+
+/*
+ * Create an incremental encoder for the given level, compressing each batch
+ * of chunks on up to numThreads threads.
+ */
+LZ10Encoder *lz10_encoder_create(int level, unsigned numThreads);
+
+/*
+ * Start a new stream of totalSize input bytes, whose compressed form is passed
+ * to sink as it is produced. The encoder can be reused for several streams.
+ */
+int lz10_encoder_begin(LZ10Encoder *e, size_t totalSize, LZ10Sink sink,
+                       void *user);
+
+/*
+ * Feed the next size bytes of input.
+ */
+int lz10_encoder_feed(LZ10Encoder *e, const uint8_t *data, size_t size);
+
+/*
+ * Flush the end of the stream and store its compressed size, header included,
+ * in outSize. Fail if less input was fed than announced.
+ */
+int lz10_encoder_finish(LZ10Encoder *e, size_t *outSize);
+
+/*
+ * Release an incremental encoder and every buffer it owns.
+ */
+void lz10_encoder_destroy(LZ10Encoder *e);
+
+/*
+ * Incremental decoder. It takes compressed data in pieces of any size and
+ * passes the output to a sink as it is decoded, keeping only the 0x1000-byte
+ * window and a 64 KiB output block in memory.
+ */
+typedef struct LZ10Decoder LZ10Decoder;
+
+/*
+ * Create an incremental decoder.
+ */
+LZ10Decoder *lz10_decoder_create(void);
+
+/*
+ * Start decoding a new stream, whose output is passed to sink. The decoder can
+ * be reused for several streams.
+ */
+int lz10_decoder_begin(LZ10Decoder *d, LZ10Sink sink, void *user);
+
+/*
+ * Feed the next size bytes of compressed data, header included. Bytes past the
+ * end of the stream are ignored.
+ */
+int lz10_decoder_feed(LZ10Decoder *d, const uint8_t *data, size_t size);
+
+/*
+ * Decode the remaining input, pass the end of the output to the sink and
+ * store the decompressed size in outSize. Fail if the stream was truncated.
+ */
+int lz10_decoder_finish(LZ10Decoder *d, size_t *outSize);
+
+/*
+ * Release an incremental decoder.
+ */
+void lz10_decoder_destroy(LZ10Decoder *d);
+
+/*
+ * Estimate the compressed size of a buffer by encoding its first
+ * LZ10_SAMPLE_SIZE bytes at LZ10_LEVEL_MIN and extrapolating to the whole
+ * buffer. The estimate is pessimistic, as higher levels compress better.
+ * Return the worst-case size if the sample cannot be encoded.
+ */
+size_t lz10_estimate_size(const uint8_t *src, size_t srcSize);
+
 #endif /* LZ10_H */
@@ -0,0 +1,79 @@
+/*
+ * Portable threading helpers.
+ *
+ * SPDX-FileCopyrightText: 2026 SombrAbsol
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef THREAD_H
+#define THREAD_H
+
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <windows.h>
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE Cond;
+#else
+#include <pthread.h>
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Cond;
+#endif
+
+/*
+ * A thread running fn(arg), started with thread_start.
+ */
+typedef struct {
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_t id;
+#endif
+    void (*fn)(void *arg);
+    void *arg;
+} Thread;
+
+/*
+ * Mutex wrappers around CRITICAL_SECTION on Windows, or pthread_mutex_t
+ * otherwise.
+ */
+int mutex_init(Mutex *m);
+void mutex_lock(Mutex *m);
+void mutex_unlock(Mutex *m);
+void mutex_destroy(Mutex *m);
+
+/*
+ * Condition variable wrappers around CONDITION_VARIABLE on Windows, or
+ * pthread_cond_t otherwise. cond_wait releases the mutex while it waits.
+ */
+int cond_init(Cond *c);
+void cond_wait(Cond *c, Mutex *m);
+void cond_signal(Cond *c);
+void cond_broadcast(Cond *c);
+void cond_destroy(Cond *c);
+
+/*
+ * Start a thread running fn(arg). Return 0 on success. The Thread must stay
+ * in place until thread_join returns.
+ */
+int thread_start(Thread *t, void (*fn)(void *arg), void *arg);
+void thread_join(Thread *t);
+
+/*
+ * Return the number of online CPUs, or 1 if it cannot be determined.
+ */
+unsigned cpu_count(void);
+
+/*
+ * Call fn(arg, index, worker) for every index in [0, count), spreading the
+ * calls over up to numThreads threads. Indices are handed out in increasing
+ * order; 'worker' identifies the calling thread, from 0 to numThreads - 1.
+ * Fall back to running every call on the current thread if threads cannot be
+ * created.
+ */
+void parallel_for(unsigned numThreads, size_t count,
+                  void (*fn)(void *arg, size_t index, unsigned worker),
+                  void *arg);
+
+#endif /* THREAD_H */
@@ -40,6 +40,62 @@ char *xstrdup(const char *s);
  */
 uint8_t *read_file(const char *path, size_t *outSize);
 
+/*
+ * Read everything left in a stream into memory.
+ */
+uint8_t *read_stream(FILE *f, size_t *outSize);
+
+/*
+ * A read-only view of a whole file, memory-mapped where supported and loaded
+ * with read_file otherwise.
+ */
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    int mapped; // data is a mapping rather than a heap copy
+    int fd;     // descriptor of a mapping, or -1
+} MappedFile;
+
+/*
+ * Open a file, or stdin for "-", as a MappedFile, to release with unmap_file.
+ */
+int map_file(const char *path, MappedFile *m);
+void unmap_file(MappedFile *m);
+
+/*
+ * Write a byte range of a mapped file to a new file, copying inside the kernel
+ * where supported.
+ */
+int write_file_range(const char *path, const MappedFile *src, size_t offset,
+                     size_t size);
+
+/*
+ * Get the size of an open file and seek back to its start. Return -1 on
+ * failure.
+ */
+long long file_size(FILE *f);
+
+/*
+ * Read exactly 'size' bytes at 'offset' of an open file.
+ */
+int read_file_at(FILE *f, long long offset, void *buf, size_t size);
+
+/*
+ * Incremental 64-bit FNV-1a hash; start from HASH64_INIT.
+ */
+#define HASH64_INIT 0xcbf29ce484222325ULL
+uint64_t hash64(uint64_t h, const void *data, size_t size);
+
+/*
+ * Check whether a file exists with the given size and hash64 hash.
+ */
+int file_matches(const char *path, unsigned long long size, uint64_t hash);
+
+/*
+ * Cut an open file down to 'size' bytes, after flushing pending writes.
+ */
+int truncate_file(FILE *f, long long size);
+
 /*
  * Write bytes to a file, creating or truncating it as needed.
  */
@@ -76,13 +132,19 @@ char *unescape_json_string(const char *start, size_t len);
 
 /*
  * Parse/write a flat JSON object, mapping the literals true, false, and null to
- * the integers 1, 0, and -1 respectively.
+ * the integers 1, 0, and -1 respectively, and the string "auto" to 2.
  */
 int read_json_file_states(const char *path, char ***outNames, int **outStates,
                           uint32_t *outCount);
 int write_json_file_states(const char *path, char *const *names,
                            const int *states, uint32_t count);
 
+/*
+ * Write the same JSON object as write_json_file_states to an open stream.
+ */
+int write_json_states(FILE *f, char *const *names, const int *states,
+                      uint32_t count);
+
 /*
  * Free an array of strings.
  */
@@ -0,0 +1,463 @@
+/*
+ * Batched creation of small output files.
+ *
+ * SPDX-FileCopyrightText: 2026 SombrAbsol
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "filebatch.h"
+#include "utils.h"
+
+#define BATCH_FILES 64                         // files per flush
+#define BATCH_ARENA (16 * FILE_BATCH_MAX_SIZE) // file_batch_buffer space
+#define RING_ENTRIES 256                       // 2 requests per file
+#define NO_COMPLETION INT32_MIN                // result of a pending request
+
+typedef struct {
+    char name[64];
+    const uint8_t *data;
+    size_t size;
+} QueuedFile;
+
+#ifdef __linux__
+/*
+ * An io_uring instance set up by hand, without liburing.
+ */
+typedef struct {
+    int fd;
+    unsigned *sqHead; // requests the kernel has taken
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqMap;
+    size_t sqMapSize;
+    void *cqMap; // same as sqMap with IORING_FEAT_SINGLE_MMAP
+    size_t cqMapSize;
+    size_t sqesSize;
+} Ring;
+#endif
+
+struct FileBatch {
+    char dir[512];
+    QueuedFile files[BATCH_FILES];
+    uint32_t count;
+    uint8_t *arena;
+    size_t arenaUsed;
+    int failed; // a file could not be written since the last flush
+#ifdef __linux__
+    int dirfd;   // output directory, opened once
+    int hasRing; // ring is set up
+    int uring;   // ring is set up and usable
+    Ring ring;
+#endif
+};
+
+#ifdef __linux__
+/*
+ * Release the mappings and the descriptor of a ring.
+ */
+static void ring_close(Ring *r) {
+    if (r->sqes)
+        munmap(r->sqes, r->sqesSize);
+    if (r->cqMap && r->cqMap != r->sqMap)
+        munmap(r->cqMap, r->cqMapSize);
+    if (r->sqMap)
+        munmap(r->sqMap, r->sqMapSize);
+    close(r->fd);
+}
+
+/*
+ * Append one request to the submission queue.
+ */
+static struct io_uring_sqe *ring_push(Ring *r, unsigned *tail) {
+    unsigned idx = *tail & r->sqMask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sqArray[idx] = idx;
+    ++*tail;
+    return sqe;
+}
+
+/*
+ * Submit the 'count' requests queued up to 'tail', whose user_data numbers
+ * them from 0, and wait for all of them. res[k] receives the result of request
+ * k, or NO_COMPLETION if it did not complete. If the ring fails, return
+ * EXIT_FAILURE once no request is known to be in flight, with the number of
+ * requests the kernel took in *taken; the others were never started.
+ */
+static int ring_run(Ring *r, unsigned tail, unsigned count, int32_t *res,
+                    unsigned *taken) {
+    unsigned start = __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE);
+    for (unsigned k = 0; k < count; ++k)
+        res[k] = NO_COMPLETION;
+
+    __atomic_store_n(r->sqTail, tail, __ATOMIC_RELEASE);
+
+    unsigned completed = 0;
+    int failed = 0;
+    while (completed < count) {
+        unsigned submitted =
+            __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE) - start;
+        *taken = submitted;
+
+        // once the ring fails, only wait for what the kernel already took
+        if (failed && completed == submitted)
+            return EXIT_FAILURE;
+
+        int ret = (int)syscall(__NR_io_uring_enter, r->fd,
+                               failed ? 0 : count - submitted, 1,
+                               IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR) {
+            if (failed)
+                return EXIT_FAILURE; // requests may still be in flight
+            failed = 1;
+            continue;
+        }
+
+        unsigned head = *r->cqHead;
+        unsigned cqTail = __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE);
+        for (; head != cqTail; ++head, ++completed) {
+            const struct io_uring_cqe *cqe = &r->cqes[head & r->cqMask];
+            if (cqe->user_data < count)
+                res[cqe->user_data] = cqe->res;
+        }
+        __atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    *taken = count;
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Check that the kernel knows every request a flush sends, and that it opens
+ * into direct descriptors. Kernels before 5.15 ignore file_index and return
+ * a regular descriptor, which nothing in a flush would close.
+ */
+static int ring_check(Ring *r, int dirfd) {
+    static const uint8_t ops[] = {IORING_OP_OPENAT, IORING_OP_WRITE,
+                                  IORING_OP_CLOSE};
+
+    size_t probeSize = sizeof(struct io_uring_probe) +
+                       256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probeSize);
+    if (!probe)
+        return EXIT_FAILURE;
+
+    int supported = syscall(__NR_io_uring_register, r->fd,
+                            IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; supported && i < sizeof(ops); ++i)
+        supported = ops[i] <= probe->last_op &&
+                    (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!supported)
+        return EXIT_FAILURE;
+
+    // open the output directory itself into the first slot
+    int32_t res = -1;
+    unsigned taken = 0;
+    unsigned tail = *r->sqTail;
+    struct io_uring_sqe *sqe = ring_push(r, &tail);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = dirfd;
+    sqe->addr = (uint64_t)(uintptr_t)".";
+    sqe->open_flags = O_RDONLY | O_DIRECTORY;
+    sqe->file_index = 1;
+    if (ring_run(r, tail, 1, &res, &taken) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    if (res > 0)
+        close(res); // file_index was ignored
+    if (res != 0)
+        return EXIT_FAILURE;
+
+    tail = *r->sqTail;
+    sqe = ring_push(r, &tail);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = 1;
+    if (ring_run(r, tail, 1, &res, &taken) != EXIT_SUCCESS || res != 0)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Set up a ring with a sparse table of BATCH_FILES direct descriptors, which
+ * the requests of one file use to pass its descriptor along, and check that
+ * the kernel supports it.
+ */
+static int ring_open(Ring *r, int dirfd) {
+    memset(r, 0, sizeof(*r));
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (r->fd < 0)
+        return EXIT_FAILURE;
+
+    r->sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cqMapSize > r->sqMapSize)
+            r->sqMapSize = r->cqMapSize;
+        r->cqMapSize = r->sqMapSize;
+    }
+
+    r->sqMap = mmap(NULL, r->sqMapSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sqMap == MAP_FAILED) {
+        r->sqMap = NULL;
+        goto error;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cqMap = r->sqMap;
+    } else {
+        r->cqMap = mmap(NULL, r->cqMapSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cqMap == MAP_FAILED) {
+            r->cqMap = NULL;
+            goto error;
+        }
+    }
+
+    r->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqesSize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto error;
+    }
+
+    uint8_t *sq = r->sqMap, *cq = r->cqMap;
+    r->sqHead = (unsigned *)(sq + p.sq_off.head);
+    r->sqTail = (unsigned *)(sq + p.sq_off.tail);
+    r->sqMask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sqArray = (unsigned *)(sq + p.sq_off.array);
+    r->cqHead = (unsigned *)(cq + p.cq_off.head);
+    r->cqTail = (unsigned *)(cq + p.cq_off.tail);
+    r->cqMask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    int fds[BATCH_FILES];
+    for (int i = 0; i < BATCH_FILES; ++i)
+        fds[i] = -1;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, fds,
+                BATCH_FILES) != 0)
+        goto error;
+
+    if (ring_check(r, dirfd) != EXIT_SUCCESS)
+        goto error;
+
+    return EXIT_SUCCESS;
+
+error:
+    ring_close(r);
+    return EXIT_FAILURE;
+}
+
+/*
+ * Report a queued file whose requests the ring may still be running. It is
+ * not written again, since a late write could land on top of it.
+ */
+static void flush_lost(FileBatch *b, uint32_t i) {
+    fprintf(stderr, "file_batch_flush: failed writing %s/%s\n", b->dir,
+            b->files[i].name);
+    b->failed = 1;
+}
+
+/*
+ * Open and write every queued file through the ring, as two linked requests
+ * per file sharing direct descriptor slot i, then close the slots that were
+ * opened with requests of their own, so that a failed or short write cannot
+ * cancel a close. Set pending[i] for the files that still have to be written
+ * another way. If the ring fails, it is not used again.
+ */
+static void flush_uring(FileBatch *b, uint8_t *pending) {
+    Ring *r = &b->ring;
+    int32_t res[2 * BATCH_FILES];
+    unsigned taken = 0;
+
+    unsigned tail = *r->sqTail;
+    for (uint32_t i = 0; i < b->count; ++i) {
+        const QueuedFile *f = &b->files[i];
+
+        struct io_uring_sqe *sqe = ring_push(r, &tail);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->fd = b->dirfd;
+        sqe->addr = (uint64_t)(uintptr_t)f->name;
+        sqe->len = 0666; // same mode as fopen
+        // direct descriptors are never inherited, and reject O_CLOEXEC
+        sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+        sqe->file_index = i + 1;
+        sqe->user_data = 2 * i;
+
+        sqe = ring_push(r, &tail);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->fd = (int)i;
+        sqe->addr = (uint64_t)(uintptr_t)f->data;
+        sqe->len = (uint32_t)f->size;
+        sqe->user_data = 2 * i + 1;
+    }
+
+    if (ring_run(r, tail, 2 * b->count, res, &taken) != EXIT_SUCCESS) {
+        b->uring = 0;
+        for (uint32_t i = 0; i < b->count; ++i) {
+            int lost = (2 * i < taken && res[2 * i] == NO_COMPLETION) ||
+                       (2 * i + 1 < taken && res[2 * i + 1] == NO_COMPLETION);
+            if (lost)
+                flush_lost(b, i);
+            else
+                pending[i] = res[2 * i] != 0 ||
+                             res[2 * i + 1] != (int32_t)b->files[i].size;
+        }
+        return; // the slots are released with the ring
+    }
+
+    // a write is cancelled when its open fails; either way the file is retried
+    uint32_t opened[BATCH_FILES];
+    unsigned numOpened = 0;
+    for (uint32_t i = 0; i < b->count; ++i) {
+        pending[i] = res[2 * i] != 0 ||
+                     res[2 * i + 1] != (int32_t)b->files[i].size;
+        if (res[2 * i] == 0)
+            opened[numOpened++] = i;
+    }
+
+    if (!numOpened)
+        return;
+
+    tail = *r->sqTail;
+    for (unsigned k = 0; k < numOpened; ++k) {
+        struct io_uring_sqe *sqe = ring_push(r, &tail);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = opened[k] + 1;
+        sqe->user_data = k;
+    }
+
+    if (ring_run(r, tail, numOpened, res, &taken) != EXIT_SUCCESS)
+        b->uring = 0; // the written files are complete either way
+
+    for (unsigned k = 0; k < numOpened; ++k) {
+        if (res[k] != 0 && res[k] != NO_COMPLETION)
+            pending[opened[k]] = 1;
+    }
+}
+#endif
+
+FileBatch *file_batch_create(const char *dir) {
+    FileBatch *b = calloc(1, sizeof(*b));
+    uint8_t *arena = b ? malloc(BATCH_ARENA) : NULL;
+    if (!arena) {
+        fprintf(stderr, "file_batch_create: memory allocation failed\n");
+        free(b);
+        return NULL;
+    }
+
+    b->arena = arena;
+    snprintf(b->dir, sizeof(b->dir), "%s", dir);
+
+#ifdef __linux__
+    b->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    b->hasRing =
+        b->dirfd >= 0 && ring_open(&b->ring, b->dirfd) == EXIT_SUCCESS;
+    b->uring = b->hasRing;
+#endif
+
+    return b;
+}
+
+uint8_t *file_batch_buffer(FileBatch *b, size_t size) {
+    if (size > FILE_BATCH_MAX_SIZE)
+        return NULL;
+
+    if (b->arenaUsed + size > BATCH_ARENA)
+        (void)file_batch_flush(b); // failures are returned by the next flush
+
+    uint8_t *p = b->arena + b->arenaUsed;
+    b->arenaUsed += size;
+    return p;
+}
+
+void file_batch_add(FileBatch *b, const char *name, const uint8_t *data,
+                    size_t size) {
+    QueuedFile *f = &b->files[b->count++];
+    snprintf(f->name, sizeof(f->name), "%s", name);
+    f->data = data;
+    f->size = size;
+
+    if (b->count == BATCH_FILES)
+        (void)file_batch_flush(b); // failures are returned by the next flush
+}
+
+int file_batch_flush(FileBatch *b) {
+    uint8_t pending[BATCH_FILES];
+    memset(pending, 1, sizeof(pending));
+
+#ifdef __linux__
+    if (b->uring && b->count) {
+        memset(pending, 0, sizeof(pending));
+        flush_uring(b, pending);
+    }
+#endif
+
+    // anything io_uring did not write is written the portable way
+    for (uint32_t i = 0; i < b->count; ++i) {
+        if (!pending[i])
+            continue;
+
+        char path[600];
+        snprintf(path, sizeof(path), "%s/%s", b->dir, b->files[i].name);
+        if (write_file(path, b->files[i].data, b->files[i].size) !=
+            EXIT_SUCCESS) {
+            fprintf(stderr, "file_batch_flush: failed writing %s\n", path);
+            b->failed = 1;
+        }
+    }
+
+    b->count = 0;
+    b->arenaUsed = 0;
+
+    int status = b->failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    b->failed = 0;
+    return status;
+}
+
+void file_batch_destroy(FileBatch *b) {
+    if (!b)
+        return;
+
+    (void)file_batch_flush(b);
+
+#ifdef __linux__
+    if (b->hasRing)
+        ring_close(&b->ring);
+    if (b->dirfd >= 0)
+        close(b->dirfd);
+#endif
+
+    free(b->arena);
+    free(b);
+}
@@ -6,35 +6,317 @@
  * SPDX-License-Identifier: MIT
  */
 
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) ||          \
+     defined(_M_IX86)) &&                                                      \
+    (defined(__GNUC__) || defined(__clang__))
+#define LZ10_X86_SIMD 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
 
 #include "lz10.h"
+#include "thread.h"
 
 /*
- * Decompress an LZ10 buffer.
+ * LZ10 format limits. Back-references reach at most 0x1000 bytes back and copy
+ * between 3 and 0x12 bytes. A displacement of 1 is never emitted, matching the
+ * original encoder.
  */
-uint8_t *lz10_decompress(const uint8_t *src, size_t srcSize, size_t *outSize) {
-    if (!src || srcSize < 4 || !outSize) {
-        fprintf(stderr, "lz10_decompress: invalid arguments\n");
-        return NULL;
+#define LZ10_WINDOW 0x1000
+#define LZ10_MIN_MATCH 3
+#define LZ10_MAX_MATCH 0x12
+#define LZ10_MIN_DISP 2
+
+/*
+ * Room a flag group can need at most: 8 back-references of 2 bytes each in
+ * input, and 8 back-references of up to 0x12 bytes in output, plus the bytes
+ * the wide copies may write past the last one.
+ */
+#define DECODE_GROUP_IN 16
+#define DECODE_GROUP_OUT (8 * LZ10_MAX_MATCH + 16)
+
+/*
+ * Report a decoding error on behalf of fn, or nothing if fn is NULL.
+ */
+__attribute__((format(printf, 2, 3))) static void
+decode_error(const char *fn, const char *fmt, ...) {
+    if (!fn)
+        return;
+
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "%s: ", fn);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+}
+
+/*
+ * Decode the flag group at sp into *dpp without bounds checks. The caller
+ * makes sure that 1 + DECODE_GROUP_IN input bytes and DECODE_GROUP_OUT output
+ * bytes are available; back-references are validated against the output
+ * start dst. Return the input position after the group, or NULL on error.
+ */
+static inline const uint8_t *decode_group_fast(const char *fn,
+                                               const uint8_t *sp,
+                                               uint8_t **dpp,
+                                               const uint8_t *dst) {
+    uint8_t *dp = *dpp;
+    uint8_t flags = *sp++;
+
+    // 8 literals in a row
+    if (flags == 0) {
+        memcpy(dp, sp, 8);
+        *dpp = dp + 8;
+        return sp + 8;
+    }
+
+    for (int bit = 0; bit < 8; ++bit, flags <<= 1) {
+        if ((flags & 0x80) == 0) {
+            *dp++ = *sp++;
+            continue;
+        }
+
+        size_t disp = (size_t)((((sp[0] & 0x0F) << 8) | sp[1]) + 1);
+        size_t length = (size_t)(sp[0] >> 4) + 3;
+        sp += 2;
+
+        if ((size_t)(dp - dst) < disp) {
+            decode_error(fn, "invalid back-reference (disp=%zu)", disp);
+            return NULL;
+        }
+
+        const uint8_t *ref = dp - disp;
+        if (disp >= 16) {
+            // one 16-byte move covers all but the longest matches
+            memcpy(dp, ref, 16);
+            if (length > 16)
+                memcpy(dp + 16, ref + 16, 2);
+        } else if (disp >= 8) {
+            // each move only reads bytes that are already final
+            for (size_t k = 0; k < length; k += 8)
+                memcpy(dp + k, ref + k, 8);
+        } else {
+            // overlapping copy repeating the last disp bytes
+            for (size_t k = 0; k < length; ++k)
+                dp[k] = ref[k];
+        }
+        dp += length;
+    }
+
+    *dpp = dp;
+    return sp;
+}
+
+/*
+ * Decode the flag group at sp into *dpp, checking every symbol against the
+ * input end send and stopping at the output end dend. Return the input
+ * position after the group, or NULL on error.
+ */
+static const uint8_t *decode_group_careful(const char *fn, const uint8_t *sp,
+                                           const uint8_t *send, uint8_t **dpp,
+                                           uint8_t *dend, const uint8_t *dst) {
+    uint8_t *dp = *dpp;
+    uint8_t flags = *sp++;
+
+    // process 8 symbols (MSB first)
+    for (int bit = 0; bit < 8 && dp < dend; ++bit) {
+        if ((flags & 0x80) == 0) {
+            // literal byte
+            if (sp >= send) {
+                decode_error(fn, "unexpected end of input (literal)");
+                return NULL;
+            }
+            *dp++ = *sp++;
+        } else {
+            // compressed block (back-reference)
+            if (sp + 1 >= send) {
+                decode_error(fn, "unexpected end of input (backref)");
+                return NULL;
+            }
+
+            uint8_t b1 = *sp++;
+            uint8_t b2 = *sp++;
+
+            // lower 12 bits: displacement (stored as disp-1)
+            size_t disp = (size_t)((((b1 & 0x0F) << 8) | b2) + 1);
+
+            // validate back-reference
+            if ((size_t)(dp - dst) < disp) {
+                decode_error(fn, "invalid back-reference (disp=%zu)", disp);
+                return NULL;
+            }
+
+            // upper 4 bits: length (stored as len-3)
+            int length = (b1 >> 4) + 3;
+
+            uint8_t *src_copy = dp - disp;
+
+            // copy referenced bytes (overlap allowed)
+            for (int k = 0; k < length && dp < dend; ++k) {
+                *dp++ = *src_copy++;
+            }
+        }
+
+        flags <<= 1;
     }
 
+    *dpp = dp;
+    return sp;
+}
+
+/*
+ * Decode the LZ10 symbols in [sp, send) into dst, stopping once decSize bytes
+ * have been produced or the input runs out. Whole flag groups are decoded
+ * without bounds checks while both buffers have room for the worst case; only
+ * the last few go through the careful per-symbol path. Return the end of the
+ * decoded data, or NULL on error.
+ */
+static uint8_t *decode_symbols(const char *fn, const uint8_t *sp,
+                               const uint8_t *send, uint8_t *dst,
+                               size_t decSize) {
+    uint8_t *dp = dst;             // destination pointer
+    uint8_t *dend = dst + decSize; // destination end
+
+    // process flag groups
+    while (dp < dend && sp < send) {
+        if ((size_t)(send - sp) > DECODE_GROUP_IN &&
+            (size_t)(dend - dp) >= DECODE_GROUP_OUT)
+            sp = decode_group_fast(fn, sp, &dp, dst);
+        else
+            sp = decode_group_careful(fn, sp, send, &dp, dend, dst);
+
+        if (!sp)
+            return NULL;
+    }
+
+    return dp;
+}
+
+/*
+ * Validate an LZ10 header and return the decompressed size it declares, or 0
+ * on error.
+ */
+static uint32_t read_header(const char *fn, const uint8_t *src) {
     uint8_t method = src[0];
     if (method != 0x10) {
-        fprintf(stderr, "lz10_decompress: unsupported method 0x%02X\n", method);
-        return NULL;
+        decode_error(fn, "unsupported method 0x%02X", method);
+        return 0;
     }
 
     uint32_t decSize =
         (uint32_t)src[1] | ((uint32_t)src[2] << 8) | ((uint32_t)src[3] << 16);
-    if (decSize == 0) {
-        fprintf(stderr, "lz10_decompress: zero decompressed size\n");
+    if (decSize == 0)
+        decode_error(fn, "zero decompressed size");
+
+    return decSize;
+}
+
+/*
+ * Decode the symbols following an LZ10 header into dst, checking that they
+ * produce exactly decSize bytes. Return 0 on success.
+ */
+static int decode_exact(const char *fn, const uint8_t *src, size_t srcSize,
+                        uint8_t *dst, uint32_t decSize) {
+    uint8_t *end = decode_symbols(fn, src + 4, src + srcSize, dst, decSize);
+    if (!end)
+        return -1;
+
+    // ensure exact output size was produced
+    if (end != dst + decSize) {
+        decode_error(fn, "size mismatch (expected %u)", decSize);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Return the decompressed size declared by an LZ10 header, without decoding
+ * anything, or 0 if src does not start with a valid LZ10 header.
+ */
+size_t lz10_peek_size(const uint8_t *src, size_t srcSize) {
+    if (!src || srcSize < 4 || src[0] != 0x10)
+        return 0;
+
+    return (size_t)src[1] | ((size_t)src[2] << 8) | ((size_t)src[3] << 16);
+}
+
+/*
+ * Decode only the first n bytes of an LZ10 buffer into dst, or all of it if
+ * shorter. The rest of the input is not looked at, and nothing is reported:
+ * callers sniffing entries decide what a failure means.
+ */
+int lz10_decompress_prefix(const uint8_t *src, size_t srcSize, uint8_t *dst,
+                           size_t n, size_t *outSize) {
+    if (!src || srcSize < 4 || (!dst && n) || !outSize)
+        return -1;
+
+    uint32_t decSize = read_header(NULL, src);
+    if (decSize == 0)
+        return -1;
+
+    if (n > decSize)
+        n = decSize;
+
+    uint8_t *end = decode_symbols(NULL, src + 4, src + srcSize, dst, n);
+    if (!end || end != dst + n)
+        return -1;
+
+    *outSize = n;
+    return 0;
+}
+
+/*
+ * Decompress an LZ10 buffer into dst, which must hold at least the size
+ * declared by the header (see lz10_peek_size).
+ */
+int lz10_decompress_into(const uint8_t *src, size_t srcSize, uint8_t *dst,
+                         size_t dstCap, size_t *outSize) {
+    if (!src || srcSize < 4 || !dst || !outSize) {
+        fprintf(stderr, "lz10_decompress_into: invalid arguments\n");
+        return -1;
+    }
+
+    uint32_t decSize = read_header("lz10_decompress_into", src);
+    if (decSize == 0)
+        return -1;
+
+    if (decSize > dstCap) {
+        fprintf(stderr,
+                "lz10_decompress_into: output buffer too small (%zu bytes, "
+                "%u needed)\n",
+                dstCap, decSize);
+        return -1;
+    }
+
+    if (decode_exact("lz10_decompress_into", src, srcSize, dst, decSize) != 0)
+        return -1;
+
+    *outSize = decSize;
+    return 0;
+}
+
+/*
+ * Decompress an LZ10 buffer.
+ */
+uint8_t *lz10_decompress(const uint8_t *src, size_t srcSize, size_t *outSize) {
+    if (!src || srcSize < 4 || !outSize) {
+        fprintf(stderr, "lz10_decompress: invalid arguments\n");
         return NULL;
     }
 
+    uint32_t decSize = read_header("lz10_decompress", src);
+    if (decSize == 0)
+        return NULL;
+
     uint8_t *dst = malloc(decSize);
     if (!dst) {
         fprintf(stderr,
@@ -43,181 +325,1508 @@ uint8_t *lz10_decompress(const uint8_t *src, size_t srcSize, size_t *outSize) {
         return NULL;
     }
 
+    if (decode_exact("lz10_decompress", src, srcSize, dst, decSize) != 0) {
+        free(dst);
+        return NULL;
+    }
+
+    *outSize = decSize;
+    return dst;
+}
+
+/*
+ * Check that an LZ10 buffer decodes cleanly without producing any output:
+ * symbols are only counted, and back-references checked against the count.
+ * Accept exactly what lz10_decompress accepts. Nothing is reported, so that
+ * callers checking archives decide how a bad entry is shown.
+ */
+int lz10_validate(const uint8_t *src, size_t srcSize, size_t *outSize) {
+    if (!src || srcSize < 4 || !outSize)
+        return -1;
+
+    uint32_t decSize = read_header(NULL, src);
+    if (decSize == 0)
+        return -1;
+
     const uint8_t *sp = src + 4;         // source pointer
     const uint8_t *send = src + srcSize; // source end
-    uint8_t *dp = dst;                   // destination pointer
-    uint8_t *dend = dst + decSize;       // destination end
+    size_t produced = 0;                 // output bytes counted so far
 
     // process flag groups
-    while (dp < dend && sp < send) {
+    while (produced < decSize && sp < send) {
         uint8_t flags = *sp++;
 
-        // process 8 symbols (MSB first)
-        for (int bit = 0; bit < 8 && dp < dend; ++bit) {
+        for (int bit = 0; bit < 8 && produced < decSize; ++bit, flags <<= 1) {
             if ((flags & 0x80) == 0) {
-                // literal byte
-                if (sp >= send) {
-                    fprintf(
-                        stderr,
-                        "lz10_decompress: unexpected end of input (literal)\n");
-                    free(dst);
-                    return NULL;
-                }
-                *dp++ = *sp++;
-            } else {
-                // compressed block (back-reference)
-                if (sp + 1 >= send) {
-                    fprintf(
-                        stderr,
-                        "lz10_decompress: unexpected end of input (backref)\n");
-                    free(dst);
-                    return NULL;
-                }
+                if (sp >= send)
+                    return -1;
+                ++sp;
+                ++produced;
+                continue;
+            }
 
-                uint8_t b1 = *sp++;
-                uint8_t b2 = *sp++;
+            if (sp + 1 >= send)
+                return -1;
 
-                // lower 12 bits: displacement (stored as disp-1)
-                size_t disp = (size_t)((((b1 & 0x0F) << 8) | b2) + 1);
+            size_t disp = (size_t)((((sp[0] & 0x0F) << 8) | sp[1]) + 1);
+            size_t length = (size_t)(sp[0] >> 4) + 3;
+            sp += 2;
 
-                // validate back-reference
-                if ((size_t)(dp - dst) < disp) {
-                    fprintf(
-                        stderr,
-                        "lz10_decompress: invalid back-reference (disp=%zu)\n",
-                        disp);
-                    free(dst);
-                    return NULL;
-                }
+            if (produced < disp)
+                return -1;
 
-                // upper 4 bits: length (stored as len-3)
-                int length = (b1 >> 4) + 3;
+            produced += length < decSize - produced ? length
+                                                    : decSize - produced;
+        }
+    }
 
-                uint8_t *src_copy = dp - disp;
+    if (produced != decSize)
+        return -1;
 
-                // copy referenced bytes (overlap allowed)
-                for (int k = 0; k < length && dp < dend; ++k) {
-                    *dp++ = *src_copy++;
-                }
-            }
+    *outSize = decSize;
+    return 0;
+}
 
-            flags <<= 1;
-        }
-    }
+/*
+ * Output buffered by the incremental decoder before it goes to the sink.
+ */
+#define DECODE_BLOCK 0x10000
 
-    // ensure exact output size was produced
-    if (dp != dend) {
-        fprintf(stderr, "lz10_decompress: size mismatch (expected %u)\n",
-                decSize);
-        free(dst);
+/*
+ * Incremental decoder. Output is decoded behind the last 0x1000 bytes already
+ * produced, which is as far as a back-reference can reach, and passed to the
+ * sink whenever the buffer fills up. The input of a flag group that is not
+ * complete yet waits in 'carry' until the next call.
+ */
+struct LZ10Decoder {
+    uint8_t *buf;                       // window followed by pending output
+    size_t fill;                        // bytes held in buf
+    size_t sent;                        // bytes of buf passed to the sink
+    uint8_t carry[1 + DECODE_GROUP_IN]; // start of an incomplete flag group
+    size_t carryLen;                    // bytes held in carry
+    uint8_t header[4];                  // LZ10 header, gathered first
+    size_t headerLen;                   // bytes held in header
+    uint32_t decSize;                   // size declared by the header
+    size_t produced;                    // output bytes decoded so far
+    int failed;                         // set once an error was reported
+    LZ10Sink sink;                      // output callback
+    void *user;                         // sink argument
+};
+
+/*
+ * Create an incremental decoder.
+ */
+LZ10Decoder *lz10_decoder_create(void) {
+    LZ10Decoder *d = calloc(1, sizeof(*d));
+    uint8_t *buf = d ? malloc(LZ10_WINDOW + DECODE_BLOCK) : NULL;
+    if (!buf) {
+        fprintf(stderr, "lz10_decoder_create: memory allocation failed\n");
+        free(d);
         return NULL;
     }
 
-    *outSize = decSize;
-    return dst;
+    d->buf = buf;
+    return d;
 }
 
 /*
- * Compress a buffer using an LZ10 encoder. Use a greedy longest-match search
- * within a sliding window of up to 0x1000 bytes, with a maximum match length
- * of 0x12 bytes.
+ * Start decoding a new stream, whose output is passed to sink.
  */
-uint8_t *lz10_compress(const uint8_t *src, size_t srcSize, size_t *outSize) {
-    if (!src || !outSize) {
-        fprintf(stderr, "lz10_compress: invalid arguments\n");
-        return NULL;
+int lz10_decoder_begin(LZ10Decoder *d, LZ10Sink sink, void *user) {
+    if (!d || !sink) {
+        fprintf(stderr, "lz10_decoder_begin: invalid arguments\n");
+        return -1;
     }
 
-    if (srcSize > 0xFFFFFF) {
-        fprintf(stderr, "lz10_compress: input too large (%zu bytes)\n",
-                srcSize);
-        return NULL;
+    d->fill = 0;
+    d->sent = 0;
+    d->carryLen = 0;
+    d->headerLen = 0;
+    d->decSize = 0;
+    d->produced = 0;
+    d->failed = 0;
+    d->sink = sink;
+    d->user = user;
+    return 0;
+}
+
+/*
+ * Pass the output not sent yet to the sink and keep the last 0x1000 bytes as
+ * window.
+ */
+static int decoder_flush(LZ10Decoder *d) {
+    if (d->fill > d->sent &&
+        d->sink(d->user, d->buf + d->sent, d->fill - d->sent) != 0) {
+        fprintf(stderr, "lz10_decoder: output failed\n");
+        return -1;
     }
 
-    /*
-     * Worst-case size: 4 bytes for the header, plus the full source size if
-     * all data is emitted as literals, plus one flag byte for every 8 symbols.
-     */
-    size_t maxSize = 4 + srcSize + ((srcSize + 7) >> 3);
+    size_t keep = d->fill < LZ10_WINDOW ? d->fill : LZ10_WINDOW;
+    memmove(d->buf, d->buf + d->fill - keep, keep);
+    d->fill = keep;
+    d->sent = keep;
+    return 0;
+}
 
-    uint8_t *out = calloc(maxSize, 1);
-    if (!out) {
-        fprintf(stderr, "lz10_compress: memory allocation failed\n");
+/*
+ * Decode the flag group at sp, whose input ends before send. Return the input
+ * position after the group, or NULL on error.
+ */
+static const uint8_t *decoder_group(LZ10Decoder *d, const char *fn,
+                                    const uint8_t *sp, const uint8_t *send) {
+    if (LZ10_WINDOW + DECODE_BLOCK - d->fill < DECODE_GROUP_OUT &&
+        decoder_flush(d) != 0)
         return NULL;
+
+    uint8_t *start = d->buf + d->fill;
+    uint8_t *dp = start;
+    uint8_t *dend = start + (d->decSize - d->produced);
+
+    if ((size_t)(send - sp) > DECODE_GROUP_IN &&
+        d->decSize - d->produced >= DECODE_GROUP_OUT)
+        sp = decode_group_fast(fn, sp, &dp, d->buf);
+    else
+        sp = decode_group_careful(fn, sp, send, &dp, dend, d->buf);
+
+    d->fill += (size_t)(dp - start);
+    d->produced += (size_t)(dp - start);
+    return sp;
+}
+
+/*
+ * Feed the next size bytes of compressed data, header included. Bytes past the
+ * end of the stream are ignored.
+ */
+int lz10_decoder_feed(LZ10Decoder *d, const uint8_t *data, size_t size) {
+    if (!d || (!data && size)) {
+        fprintf(stderr, "lz10_decoder_feed: invalid arguments\n");
+        return -1;
     }
 
-    // write header
-    out[0] = 0x10;
-    out[1] = (uint8_t)(srcSize & 0xFF);
-    out[2] = (uint8_t)((srcSize >> 8) & 0xFF);
-    out[3] = (uint8_t)((srcSize >> 16) & 0xFF);
+    if (d->failed)
+        return -1;
+
+    while (size && d->headerLen < 4) {
+        d->header[d->headerLen++] = *data++;
+        --size;
+
+        if (d->headerLen == 4) {
+            d->decSize = read_header("lz10_decoder_feed", d->header);
+            if (d->decSize == 0)
+                goto error;
+        }
+    }
 
-    const uint8_t *raw = src;
-    const uint8_t *rawEnd = src + srcSize;
-    uint8_t *pak = out + 4;
+    // complete the flag group left over from the previous call
+    while (size && d->carryLen && d->produced < d->decSize) {
+        size_t take = sizeof(d->carry) - d->carryLen;
+        if (take > size)
+            take = size;
 
-    uint8_t *flagp = NULL; // pointer to current flag byte
-    uint8_t mask = 0;      // current bit mask
+        memcpy(d->carry + d->carryLen, data, take);
+        if (d->carryLen + take < sizeof(d->carry)) {
+            d->carryLen += take;
+            return 0;
+        }
+
+        const uint8_t *sp = decoder_group(d, "lz10_decoder_feed", d->carry,
+                                          d->carry + sizeof(d->carry));
+        if (!sp)
+            goto error;
 
-    while (raw < rawEnd) {
-        // start a new flag byte every 8 items
-        if (!(mask >>= 1)) {
-            flagp = pak++;
-            *flagp = 0;
-            mask = 0x80;
+        size_t used = (size_t)(sp - d->carry);
+        if (used >= d->carryLen) {
+            // the group ended in the new data
+            data += used - d->carryLen;
+            size -= used - d->carryLen;
+            d->carryLen = 0;
+        } else {
+            // the group ended in the carried bytes; drop the copied data
+            memmove(d->carry, d->carry + used, d->carryLen - used);
+            d->carryLen -= used;
         }
+    }
 
-        size_t bestLen = 2; // minimum match threshold
-        size_t bestPos = 0;
+    // whole flag groups straight from the input
+    const uint8_t *sp = data;
+    const uint8_t *send = data + size;
+    while (d->produced < d->decSize && (size_t)(send - sp) > DECODE_GROUP_IN) {
+        sp = decoder_group(d, "lz10_decoder_feed", sp, send);
+        if (!sp)
+            goto error;
+    }
 
-        // search window size (max 0x1000 bytes back)
-        size_t maxPos = (size_t)(raw - src);
-        if (maxPos > 0x1000)
-            maxPos = 0x1000;
+    if (d->produced < d->decSize) {
+        memcpy(d->carry + d->carryLen, sp, (size_t)(send - sp));
+        d->carryLen += (size_t)(send - sp);
+    }
 
-        // maximum match length
-        size_t maxLen = (size_t)(rawEnd - raw);
-        if (maxLen > 0x12)
-            maxLen = 0x12;
+    return 0;
 
-        // brute-force search for longest match
-        for (size_t p = maxPos; p > 1; --p) {
-            if (raw[0] != raw[-(ptrdiff_t)p])
-                continue;
+error:
+    d->failed = 1;
+    return -1;
+}
 
-            size_t l = 1;
-            const uint8_t *a = raw + 1;
-            const uint8_t *b = raw - p + 1;
+/*
+ * Decode the remaining input, pass the end of the output to the sink and
+ * store the decompressed size in outSize. Fail if the stream was truncated.
+ */
+int lz10_decoder_finish(LZ10Decoder *d, size_t *outSize) {
+    if (!d || !outSize) {
+        fprintf(stderr, "lz10_decoder_finish: invalid arguments\n");
+        return -1;
+    }
 
-            while (l < maxLen && *a == *b) {
-                ++a;
-                ++b;
-                ++l;
-            }
+    if (d->failed)
+        return -1;
 
-            if (l > bestLen) {
-                bestLen = l;
-                bestPos = p;
-            }
-        }
+    if (d->headerLen < 4) {
+        fprintf(stderr, "lz10_decoder_finish: truncated header\n");
+        return -1;
+    }
+
+    // the carried bytes are all the input that is left
+    const uint8_t *sp = d->carry;
+    const uint8_t *send = d->carry + d->carryLen;
+    while (d->produced < d->decSize && sp < send) {
+        sp = decoder_group(d, "lz10_decoder_finish", sp, send);
+        if (!sp)
+            return -1;
+    }
+    d->carryLen = 0;
 
-        if (bestLen > 2) {
-            // encode compressed block
-            *flagp |= mask;
+    // ensure exact output size was produced
+    if (d->produced != d->decSize) {
+        fprintf(stderr, "lz10_decoder_finish: size mismatch (expected %u)\n",
+                d->decSize);
+        return -1;
+    }
 
-            size_t lenField = bestLen - 3;
-            size_t posField = bestPos - 1;
+    if (decoder_flush(d) != 0)
+        return -1;
 
-            *pak++ = (uint8_t)((lenField << 4) | (posField >> 8));
-            *pak++ = (uint8_t)(posField & 0xFF);
+    *outSize = d->produced;
+    return 0;
+}
 
-            raw += bestLen;
-        } else {
-            // literal byte
-            *pak++ = *raw++;
+/*
+ * Release an incremental decoder.
+ */
+void lz10_decoder_destroy(LZ10Decoder *d) {
+    if (!d)
+        return;
+
+    free(d->buf);
+    free(d);
+}
+
+/*
+ * Match finder parameters. Each chain never holds more than LZ10_WINDOW live
+ * positions, so a depth of LZ10_WINDOW makes the search exhaustive.
+ */
+#define LZ10_HASH_BITS 13
+#define LZ10_HASH_SIZE (1u << LZ10_HASH_BITS)
+#define LZ10_MAX_CHAIN LZ10_WINDOW
+
+/*
+ * Search parameters for each compression level. Levels 1-5 deepen the greedy
+ * search. A level runs every parse it lists and keeps the smallest: levels 6-8
+ * run the parses of the level below and add one or search deeper, and level 9
+ * is the exhaustive optimal parse, which no other parse beats.
+ */
+typedef struct {
+    unsigned greedy;  // chain links walked per greedy search, 0 for none
+    unsigned nice;    // stop searching once a match this long is found
+    unsigned lazy;    // chain links walked per lazy search, 0 for none
+    unsigned near;    // chain links walked by the near-optimal parse, or 0
+    unsigned optimal; // chain links walked by the optimal parse, 0 for none
+} LevelParams;
+
+static const LevelParams levelParams[LZ10_LEVEL_MAX] = {
+    {4, 8, 0, 0, 0},                                          // 1
+    {16, 12, 0, 0, 0},                                        // 2
+    {64, LZ10_MAX_MATCH, 0, 0, 0},                            // 3
+    {256, LZ10_MAX_MATCH, 0, 0, 0},                           // 4
+    {LZ10_MAX_CHAIN, LZ10_MAX_MATCH, 0, 0, 0},                // 5 (default)
+    {LZ10_MAX_CHAIN, LZ10_MAX_MATCH, LZ10_MAX_CHAIN, 0, 0},   // 6
+    {LZ10_MAX_CHAIN, LZ10_MAX_MATCH, LZ10_MAX_CHAIN, 64, 0},  // 7
+    {LZ10_MAX_CHAIN, LZ10_MAX_MATCH, LZ10_MAX_CHAIN, 256, 0}, // 8
+    {0, LZ10_MAX_MATCH, 0, 0, LZ10_MAX_CHAIN},                // 9
+};
+
+/*
+ * Match length kernel. Return the number of leading bytes, up to maxLen, that
+ * a and b have in common. 'avail' bytes may be read from both pointers, and
+ * avail >= maxLen.
+ */
+typedef size_t (*MatchLenFn)(const uint8_t *a, const uint8_t *b, size_t maxLen,
+                             size_t avail);
+
+/*
+ * Portable kernel, comparing one byte at a time.
+ */
+static size_t match_len_scalar(const uint8_t *a, const uint8_t *b,
+                               size_t maxLen, size_t avail) {
+    (void)avail; // never reads past maxLen
+    size_t l = 0;
+    while (l < maxLen && a[l] == b[l])
+        ++l;
+    return l;
+}
+
+#ifdef LZ10_X86_SIMD
+/*
+ * SSE2 kernel, comparing 16 bytes per step while that many can be read.
+ */
+__attribute__((target("sse2"))) static size_t
+match_len_sse2(const uint8_t *a, const uint8_t *b, size_t maxLen,
+               size_t avail) {
+    size_t l = 0;
+    for (; l < maxLen && avail - l >= 16; l += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + l));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + l));
+        unsigned diff =
+            ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xFFFFu;
+        if (diff) {
+            l += (size_t)__builtin_ctz(diff); // first mismatching byte
+            return l < maxLen ? l : maxLen;
         }
     }
 
-    *outSize = (size_t)(pak - out);
-    return out;
+    while (l < maxLen && a[l] == b[l])
+        ++l;
+    return l < maxLen ? l : maxLen;
+}
+
+/*
+ * AVX2 kernel, comparing 32 bytes per step while that many can be read. A
+ * single step covers the longest LZ10 match.
+ */
+__attribute__((target("avx2"))) static size_t
+match_len_avx2(const uint8_t *a, const uint8_t *b, size_t maxLen,
+               size_t avail) {
+    size_t l = 0;
+    for (; l < maxLen && avail - l >= 32; l += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + l));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + l));
+        unsigned diff =
+            ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if (diff) {
+            l += (size_t)__builtin_ctz(diff); // first mismatching byte
+            return l < maxLen ? l : maxLen;
+        }
+    }
+
+    while (l < maxLen && a[l] == b[l])
+        ++l;
+    return l < maxLen ? l : maxLen;
+}
+
+/*
+ * Check through CPUID whether the CPU and the OS support AVX2.
+ */
+static int cpu_has_avx2(void) {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return 0;
+
+    // OSXSAVE and AVX
+    if (!(ecx & (1u << 27)) || !(ecx & (1u << 28)))
+        return 0;
+
+    // the OS must save the XMM and YMM registers on context switches
+    unsigned xcr0Lo, xcr0Hi;
+    __asm__ volatile("xgetbv" : "=a"(xcr0Lo), "=d"(xcr0Hi) : "c"(0));
+    (void)xcr0Hi;
+    if ((xcr0Lo & 6u) != 6u)
+        return 0;
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return 0;
+
+    return (ebx & (1u << 5)) != 0;
+}
+
+/*
+ * Check through CPUID whether the CPU supports SSE2.
+ */
+static int cpu_has_sse2(void) {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return 0;
+    return (edx & (1u << 26)) != 0;
+}
+#endif
+
+/*
+ * Pick the widest match length kernel the CPU supports. CPUID is only queried
+ * by the first call; threads racing on it store the same kernel.
+ */
+static MatchLenFn select_match_len(void) {
+    static MatchLenFn selected;
+
+    MatchLenFn fn = __atomic_load_n(&selected, __ATOMIC_RELAXED);
+    if (fn)
+        return fn;
+
+    fn = match_len_scalar;
+#ifdef LZ10_X86_SIMD
+    if (cpu_has_avx2())
+        fn = match_len_avx2;
+    else if (cpu_has_sse2())
+        fn = match_len_sse2;
+#endif
+
+    __atomic_store_n(&selected, fn, __ATOMIC_RELAXED);
+    return fn;
+}
+
+/*
+ * Hash-chain match finder. Positions are stored plus one so that zero marks an
+ * empty slot.
+ */
+typedef struct {
+    uint32_t head[LZ10_HASH_SIZE]; // most recent position for each hash
+    uint32_t prev[LZ10_WINDOW];    // previous position with the same hash
+    MatchLenFn matchLen;           // kernel selected for this CPU
+} MatchFinder;
+
+/*
+ * Empty the hash chains before encoding a new input. The prev links only
+ * become reachable again once their position is reinserted, so clearing the
+ * heads is enough.
+ */
+static void mf_reset(MatchFinder *mf) {
+    memset(mf->head, 0, sizeof(mf->head));
+}
+
+/*
+ * Hash the 3-byte prefix starting at p.
+ */
+static uint32_t hash3(const uint8_t *p) {
+    uint32_t v =
+        (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+    return (v * 2654435761u) >> (32 - LZ10_HASH_BITS);
+}
+
+/*
+ * Insert position pos into the hash chains. At least 3 bytes must be available
+ * from src + pos.
+ */
+static void mf_insert(MatchFinder *mf, const uint8_t *src, size_t pos) {
+    uint32_t h = hash3(src + pos);
+    mf->prev[pos & (LZ10_WINDOW - 1)] = mf->head[h];
+    mf->head[h] = (uint32_t)pos + 1;
+}
+
+/*
+ * Find the longest match for src + pos among the previously inserted
+ * positions, walking at most 'depth' chain links and stopping as soon as a
+ * match of 'niceLen' bytes is found. 'avail' is the number of input bytes from
+ * src + pos onwards. Return the match length, or 0 if no match of at least
+ * LZ10_MIN_MATCH bytes was found.
+ */
+static size_t mf_find(const MatchFinder *mf, const uint8_t *src, size_t pos,
+                      size_t avail, unsigned depth, size_t niceLen,
+                      size_t *outDisp) {
+    size_t maxLen = avail < LZ10_MAX_MATCH ? avail : LZ10_MAX_MATCH;
+    if (maxLen < LZ10_MIN_MATCH)
+        return 0;
+
+    const uint8_t *cur = src + pos;
+    size_t bestLen = LZ10_MIN_MATCH - 1;
+    size_t bestDisp = 0;
+    uint32_t cand = mf->head[hash3(cur)];
+
+    while (cand && depth--) {
+        size_t c = (size_t)cand - 1;
+        size_t disp = pos - c;
+        if (disp > LZ10_WINDOW) // the rest of the chain is out of reach
+            break;
+
+        const uint8_t *ref = src + c;
+
+        // reject candidates that cannot beat the current best early
+        if (disp >= LZ10_MIN_DISP && ref[bestLen] == cur[bestLen] &&
+            ref[0] == cur[0]) {
+            size_t l = mf->matchLen(cur, ref, maxLen, avail);
+
+            if (l > bestLen) {
+                bestLen = l;
+                bestDisp = disp;
+                if (l >= niceLen || l == maxLen) // good enough
+                    break;
+            }
+        }
+
+        cand = mf->prev[c & (LZ10_WINDOW - 1)];
+    }
+
+    if (bestLen < LZ10_MIN_MATCH)
+        return 0;
+
+    *outDisp = bestDisp;
+    return bestLen;
+}
+
+/*
+ * Worst-case compressed size: 4 bytes for the header, plus the full source
+ * size if all data is emitted as literals, plus one flag byte for every 8
+ * symbols.
+ */
+static size_t max_compressed_size(size_t srcSize) {
+    return 4 + srcSize + ((srcSize + 7) >> 3);
+}
+
+/*
+ * Write the 4-byte LZ10 header: the method byte followed by the 24-bit
+ * decompressed size.
+ */
+static void write_header(uint8_t *out, size_t srcSize) {
+    out[0] = 0x10;
+    out[1] = (uint8_t)(srcSize & 0xFF);
+    out[2] = (uint8_t)((srcSize >> 8) & 0xFF);
+    out[3] = (uint8_t)((srcSize >> 16) & 0xFF);
+}
+
+/*
+ * Output state for emitting LZ10 symbols, grouped 8 at a time behind a flag
+ * byte.
+ */
+typedef struct {
+    uint8_t *pak;   // next output byte
+    uint8_t *flagp; // pointer to current flag byte
+    uint8_t mask;   // current bit mask
+    size_t count;   // symbols emitted so far
+} TokenWriter;
+
+/*
+ * Start emitting symbols at out.
+ */
+static void tw_init(TokenWriter *tw, uint8_t *out) {
+    tw->pak = out;
+    tw->flagp = NULL;
+    tw->mask = 0;
+    tw->count = 0;
+}
+
+/*
+ * Start a new flag byte every 8 symbols.
+ */
+static void tw_next(TokenWriter *tw) {
+    if (!(tw->mask >>= 1)) {
+        tw->flagp = tw->pak++;
+        *tw->flagp = 0;
+        tw->mask = 0x80;
+    }
+    ++tw->count;
+}
+
+/*
+ * Emit a literal byte.
+ */
+static void tw_literal(TokenWriter *tw, uint8_t b) {
+    tw_next(tw);
+    *tw->pak++ = b;
+}
+
+/*
+ * Emit a compressed block (back-reference).
+ */
+static void tw_match(TokenWriter *tw, size_t len, size_t disp) {
+    tw_next(tw);
+    *tw->flagp |= tw->mask;
+
+    size_t lenField = len - 3;
+    size_t posField = disp - 1;
+
+    *tw->pak++ = (uint8_t)((lenField << 4) | (posField >> 8));
+    *tw->pak++ = (uint8_t)(posField & 0xFF);
+}
+
+/*
+ * Re-emit 'count' symbols from a stream written by another TokenWriter. The
+ * symbols are regrouped, so the stream may start anywhere in a flag group.
+ */
+static void tw_append(TokenWriter *tw, const uint8_t *stream, size_t count) {
+    const uint8_t *sp = stream;
+    uint8_t flags = 0;
+
+    for (size_t i = 0; i < count; ++i, flags <<= 1) {
+        if ((i & 7) == 0)
+            flags = *sp++;
+
+        if (flags & 0x80) {
+            tw_next(tw);
+            *tw->flagp |= tw->mask;
+            *tw->pak++ = *sp++;
+            *tw->pak++ = *sp++;
+        } else {
+            tw_literal(tw, *sp++);
+        }
+    }
+}
+
+/*
+ * Validate the arguments shared by the encoders.
+ */
+static int check_input(const char *fn, const uint8_t *src, size_t srcSize,
+                       const size_t *outSize) {
+    if (!src || !outSize) {
+        fprintf(stderr, "%s: invalid arguments\n", fn);
+        return -1;
+    }
+
+    if (srcSize > 0xFFFFFF) {
+        fprintf(stderr, "%s: input too large (%zu bytes)\n", fn, srcSize);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Per-thread encoder state, kept across inputs.
+ */
+typedef struct {
+    MatchFinder mf;
+    uint8_t *matchLen;   // optimal parse: longest match at each position
+    uint16_t *matchDisp; // optimal parse: its displacement
+    uint8_t *choice;     // optimal parse: chosen length per position and slot
+    size_t optCap;       // positions the optimal parse arrays can hold
+    uint8_t *parse[2];   // best and current parse when a level runs several
+    size_t parseCap;     // input positions each parse buffer can hold
+} EncoderScratch;
+
+/*
+ * Prepare an encoder scratch area, selecting the match length kernel.
+ */
+static void scratch_init(EncoderScratch *es) {
+    memset(es, 0, sizeof(*es));
+    es->mf.matchLen = select_match_len();
+}
+
+/*
+ * Release the buffers owned by an encoder scratch area.
+ */
+static void scratch_free(EncoderScratch *es) {
+    free(es->matchLen);
+    free(es->matchDisp);
+    free(es->choice);
+    free(es->parse[0]);
+    free(es->parse[1]);
+}
+
+/*
+ * Grow the optimal parse arrays to hold at least n positions. Return 0 on
+ * success.
+ */
+static int scratch_reserve(EncoderScratch *es, size_t n) {
+    if (n <= es->optCap)
+        return 0;
+
+    uint8_t *matchLen = realloc(es->matchLen, n);
+    if (!matchLen)
+        return -1;
+    es->matchLen = matchLen;
+
+    uint16_t *matchDisp = realloc(es->matchDisp, n * sizeof(*matchDisp));
+    if (!matchDisp)
+        return -1;
+    es->matchDisp = matchDisp;
+
+    uint8_t *choice = realloc(es->choice, n * 8);
+    if (!choice)
+        return -1;
+    es->choice = choice;
+
+    es->optCap = n;
+    return 0;
+}
+
+/*
+ * Index the window preceding 'start', so that matches in src[start..end) can
+ * reach back into it.
+ */
+static void prime_window(MatchFinder *mf, const uint8_t *src, size_t start,
+                         size_t end) {
+    size_t pos = start > LZ10_WINDOW ? start - LZ10_WINDOW : 0;
+    for (; pos < start; ++pos) {
+        if (end - pos >= LZ10_MIN_MATCH)
+            mf_insert(mf, src, pos);
+    }
+}
+
+/*
+ * Greedy encoder, with optional lazy matching. Encode src[start..end) into tw,
+ * walking at most 'depth' chain links per search.
+ */
+static void encode_greedy(MatchFinder *mf, unsigned depth, unsigned nice,
+                          int lazy, const uint8_t *src, size_t start,
+                          size_t end, TokenWriter *tw) {
+    prime_window(mf, src, start, end);
+
+    size_t pos = start;
+    size_t indexed = start; // positions below this one are in the hash chains
+
+    size_t len = 0;
+    size_t disp = 0;
+    int cached = 0; // len and disp already hold the search result for pos
+
+    while (pos < end) {
+        // index every position passed so far
+        for (; indexed < pos; ++indexed) {
+            if (end - indexed >= LZ10_MIN_MATCH)
+                mf_insert(mf, src, indexed);
+        }
+
+        if (!cached)
+            len = mf_find(mf, src, pos, end - pos, depth, nice, &disp);
+        cached = 0;
+
+        /*
+         * Lazy matching: emit a literal if the next position does better. Every
+         * match costs 2 bytes whatever its length, so deferring only pays off
+         * when the next match is at least 2 bytes longer.
+         */
+        if (len && lazy && len < nice && pos + 1 < end) {
+            if (end - pos >= LZ10_MIN_MATCH)
+                mf_insert(mf, src, pos);
+            indexed = pos + 1;
+
+            size_t nextDisp = 0;
+            size_t nextLen = mf_find(mf, src, pos + 1, end - pos - 1, depth,
+                                     nice, &nextDisp);
+            if (nextLen > len + 1) {
+                tw_literal(tw, src[pos]);
+                ++pos;
+                len = nextLen;
+                disp = nextDisp;
+                cached = 1;
+                continue;
+            }
+        }
+
+        if (len) {
+            tw_match(tw, len, disp);
+            pos += len;
+        } else {
+            tw_literal(tw, src[pos]);
+            ++pos;
+        }
+    }
+}
+
+/*
+ * Record the longest match at every position of src[start..end), walking at
+ * most 'depth' chain links per search. Since any shorter length is available
+ * at the same displacement, this covers every possible symbol. Return 0 on
+ * success.
+ */
+static int find_longest(EncoderScratch *es, unsigned depth, const uint8_t *src,
+                        size_t start, size_t end) {
+    size_t n = end - start;
+    if (scratch_reserve(es, n) != 0)
+        return -1;
+
+    MatchFinder *mf = &es->mf;
+    prime_window(mf, src, start, end);
+
+    for (size_t i = 0; i < n; ++i) {
+        size_t pos = start + i;
+        size_t disp = 0;
+        es->matchLen[i] = (uint8_t)mf_find(mf, src, pos, end - pos, depth,
+                                           LZ10_MAX_MATCH, &disp);
+        es->matchDisp[i] = (uint16_t)disp;
+
+        if (end - pos >= LZ10_MIN_MATCH)
+            mf_insert(mf, src, pos);
+    }
+
+    return 0;
+}
+
+/*
+ * Near-optimal encoder. Like encode_optimal, but each symbol is costed with its
+ * share of a flag byte, in eighths of a byte: 9 for a literal and 17 for a
+ * match. This drops the flag group slot from the backward pass, which is much
+ * cheaper, at the price of an occasional extra flag byte. Return 0 on success.
+ */
+static int encode_near_optimal(EncoderScratch *es, unsigned depth,
+                               const uint8_t *src, size_t start, size_t end,
+                               TokenWriter *tw) {
+    if (find_longest(es, depth, src, start, end) != 0)
+        return -1;
+
+    size_t n = end - start;
+    uint8_t *matchLen = es->matchLen;
+    uint8_t *choice = es->choice;
+
+    // only the next LZ10_MAX_MATCH positions are ever looked up
+    uint32_t cost[LZ10_MAX_MATCH + 1];
+    cost[n % (LZ10_MAX_MATCH + 1)] = 0;
+
+    for (size_t i = n; i-- > 0;) {
+        uint32_t best = 9 + cost[(i + 1) % (LZ10_MAX_MATCH + 1)];
+        uint8_t bestLen = 1;
+
+        for (size_t l = LZ10_MIN_MATCH; l <= matchLen[i]; ++l) {
+            uint32_t m = 17 + cost[(i + l) % (LZ10_MAX_MATCH + 1)];
+            if (m <= best) {
+                best = m;
+                bestLen = (uint8_t)l;
+            }
+        }
+
+        cost[i % (LZ10_MAX_MATCH + 1)] = best;
+        choice[i] = bestLen;
+    }
+
+    for (size_t i = 0; i < n;) {
+        size_t len = choice[i];
+        if (len >= LZ10_MIN_MATCH)
+            tw_match(tw, len, es->matchDisp[i]);
+        else
+            tw_literal(tw, src[start + i]);
+        i += len;
+    }
+
+    return 0;
+}
+
+/*
+ * Optimal-parse encoder. Encode src[start..end) into tw with the fewest
+ * possible bytes. After find_longest, a backward dynamic-programming pass
+ * picks the cheapest parse, tracking the symbol's slot within its flag group
+ * so that flag bytes are costed exactly. With a depth below LZ10_MAX_CHAIN,
+ * the longest matches may be missed. Return 0 on success.
+ */
+static int encode_optimal(EncoderScratch *es, unsigned depth,
+                          const uint8_t *src, size_t start, size_t end,
+                          TokenWriter *tw) {
+    if (find_longest(es, depth, src, start, end) != 0)
+        return -1;
+
+    size_t n = end - start;
+    uint8_t *matchLen = es->matchLen;
+    uint16_t *matchDisp = es->matchDisp;
+    uint8_t *choice = es->choice;
+
+    /*
+     * Backward pass. cost[i][slot] is the number of bytes needed to encode
+     * the input from position i when the next symbol takes the given slot
+     * (0-7) of its flag group; a symbol in slot 0 also pays for a new flag
+     * byte. Only the next LZ10_MAX_MATCH positions are ever looked up, so a
+     * ring is enough.
+     */
+    uint32_t cost[LZ10_MAX_MATCH + 1][8];
+    memset(cost[n % (LZ10_MAX_MATCH + 1)], 0, sizeof(cost[0]));
+
+    for (size_t i = n; i-- > 0;) {
+        uint32_t *c = cost[i % (LZ10_MAX_MATCH + 1)];
+
+        for (unsigned slot = 0; slot < 8; ++slot) {
+            unsigned next = (slot + 1) & 7;
+            uint32_t flagCost = slot == 0;
+
+            // literal byte
+            uint32_t best =
+                flagCost + 1 + cost[(i + 1) % (LZ10_MAX_MATCH + 1)][next];
+            uint8_t bestLen = 1;
+
+            // every usable length of the longest match
+            for (size_t l = LZ10_MIN_MATCH; l <= matchLen[i]; ++l) {
+                uint32_t m =
+                    flagCost + 2 + cost[(i + l) % (LZ10_MAX_MATCH + 1)][next];
+                if (m <= best) {
+                    best = m;
+                    bestLen = (uint8_t)l;
+                }
+            }
+
+            c[slot] = best;
+            choice[i * 8 + slot] = bestLen;
+        }
+    }
+
+    // replay the chosen parse
+    unsigned slot = 0;
+    for (size_t i = 0; i < n; slot = (slot + 1) & 7) {
+        size_t len = choice[i * 8 + slot];
+        if (len >= LZ10_MIN_MATCH)
+            tw_match(tw, len, matchDisp[i]);
+        else
+            tw_literal(tw, src[start + i]);
+        i += len;
+    }
+
+    return 0;
+}
+
+/*
+ * Parses a level may run, in the order encode_range tries them.
+ */
+enum { PARSE_OPTIMAL, PARSE_NEAR, PARSE_GREEDY, PARSE_LAZY, PARSE_KINDS };
+
+/*
+ * Run one parse of src[start..end) into tw, walking 'depth' chain links per
+ * search. The match finder starts empty. Return 0 on success.
+ */
+static int encode_parse(EncoderScratch *es, int kind, unsigned depth,
+                        unsigned nice, const uint8_t *src, size_t start,
+                        size_t end, TokenWriter *tw) {
+    mf_reset(&es->mf);
+
+    if (kind == PARSE_OPTIMAL)
+        return encode_optimal(es, depth, src, start, end, tw);
+    if (kind == PARSE_NEAR)
+        return encode_near_optimal(es, depth, src, start, end, tw);
+
+    encode_greedy(&es->mf, depth, nice, kind == PARSE_LAZY, src, start, end,
+                  tw);
+    return 0;
+}
+
+/*
+ * Encode src[start..end) into tw at the given level. When the level lists
+ * several parses, each is written to a fresh stream and the shortest one is
+ * appended, so that the choice does not depend on where tw stands in its flag
+ * group. Return 0 on success.
+ */
+static int encode_range(EncoderScratch *es, int level, const uint8_t *src,
+                        size_t start, size_t end, TokenWriter *tw) {
+    const LevelParams *lp = &levelParams[level - 1];
+    const unsigned depths[PARSE_KINDS] = {lp->optimal, lp->near, lp->greedy,
+                                          lp->lazy};
+
+    int parses = 0;
+    int only = 0;
+    for (int k = 0; k < PARSE_KINDS; ++k) {
+        if (depths[k]) {
+            ++parses;
+            only = k;
+        }
+    }
+
+    if (parses == 1)
+        return encode_parse(es, only, depths[only], lp->nice, src, start, end,
+                            tw);
+
+    size_t n = end - start;
+    if (n > es->parseCap) {
+        for (int i = 0; i < 2; ++i) {
+            uint8_t *buf = realloc(es->parse[i], max_compressed_size(n));
+            if (!buf)
+                return -1;
+            es->parse[i] = buf;
+        }
+        es->parseCap = n;
+    }
+
+    int best = -1; // parse buffer holding the shortest parse so far
+    size_t bestSize = 0;
+    size_t bestCount = 0;
+
+    for (int k = 0; k < PARSE_KINDS; ++k) {
+        if (!depths[k])
+            continue;
+
+        int slot = best == 0;
+        TokenWriter parse;
+        tw_init(&parse, es->parse[slot]);
+        if (encode_parse(es, k, depths[k], lp->nice, src, start, end,
+                         &parse) != 0)
+            return -1;
+
+        size_t size = (size_t)(parse.pak - es->parse[slot]);
+        if (best < 0 || size < bestSize) {
+            best = slot;
+            bestSize = size;
+            bestCount = parse.count;
+        }
+    }
+
+    tw_append(tw, es->parse[best], bestCount);
+    return 0;
+}
+
+/*
+ * Chunk size for the parallel path. Fixed, so that the output never depends
+ * on the number of threads.
+ */
+#define LZ10_CHUNK_SIZE 0x80000
+
+/*
+ * Reusable compressor context.
+ */
+struct LZ10Compressor {
+    int level;               // compression level
+    unsigned numThreads;     // maximum threads for the chunked path
+    EncoderScratch *scratch; // one per thread
+    uint8_t *out;            // output buffer, grown as needed
+    size_t outCap;           // capacity of out
+    uint8_t *streams;        // symbol stream slot of each chunk
+    size_t *counts;          // symbols per chunk, SIZE_MAX on failure
+    size_t chunkCap;         // chunks the two arrays above can hold
+    const uint8_t *src;      // input being compressed in chunks
+    size_t start;            // offset of the first chunk in src
+    size_t end;              // end of the last chunk in src
+};
+
+/*
+ * Create a compressor context for the given level, able to encode large inputs
+ * on up to numThreads threads.
+ */
+LZ10Compressor *lz10_compressor_create(int level, unsigned numThreads) {
+    if (level < LZ10_LEVEL_MIN || level > LZ10_LEVEL_MAX) {
+        fprintf(stderr, "lz10_compressor_create: invalid level %d\n", level);
+        return NULL;
+    }
+
+    if (numThreads == 0)
+        numThreads = 1;
+
+    LZ10Compressor *c = calloc(1, sizeof(*c));
+    EncoderScratch *scratch =
+        c ? malloc(numThreads * sizeof(*scratch)) : NULL;
+    if (!scratch) {
+        fprintf(stderr, "lz10_compressor_create: memory allocation failed\n");
+        free(c);
+        return NULL;
+    }
+
+    for (unsigned t = 0; t < numThreads; ++t)
+        scratch_init(&scratch[t]);
+
+    c->level = level;
+    c->numThreads = numThreads;
+    c->scratch = scratch;
+    return c;
+}
+
+/*
+ * Release a compressor context and every buffer it owns.
+ */
+void lz10_compressor_destroy(LZ10Compressor *c) {
+    if (!c)
+        return;
+
+    for (unsigned t = 0; t < c->numThreads; ++t)
+        scratch_free(&c->scratch[t]);
+
+    free(c->scratch);
+    free(c->out);
+    free(c->streams);
+    free(c->counts);
+    free(c);
+}
+
+/*
+ * Encode one chunk into its own symbol stream slot. Matches may reach back
+ * into the raw input preceding the chunk, but never past its end.
+ */
+static void compress_chunk(void *arg, size_t index, unsigned worker) {
+    LZ10Compressor *c = arg;
+
+    size_t start = c->start + index * LZ10_CHUNK_SIZE;
+    size_t end =
+        c->end - start > LZ10_CHUNK_SIZE ? start + LZ10_CHUNK_SIZE : c->end;
+
+    TokenWriter tw;
+    tw_init(&tw, c->streams + index * max_compressed_size(LZ10_CHUNK_SIZE));
+
+    if (encode_range(&c->scratch[worker], c->level, c->src, start, end, &tw) !=
+        0) {
+        c->counts[index] = SIZE_MAX;
+        return;
+    }
+
+    c->counts[index] = tw.count;
+}
+
+/*
+ * Encode src[start..end) as consecutive LZ10_CHUNK_SIZE chunks on the context
+ * threads and append their symbols to tw. Return 0 on success.
+ */
+static int encode_chunks(LZ10Compressor *c, const uint8_t *src, size_t start,
+                         size_t end, TokenWriter *tw) {
+    size_t numChunks = (end - start + LZ10_CHUNK_SIZE - 1) / LZ10_CHUNK_SIZE;
+
+    // a single chunk yields the same symbols when encoded in place
+    if (numChunks == 1)
+        return encode_range(&c->scratch[0], c->level, src, start, end, tw);
+
+    if (numChunks > c->chunkCap) {
+        uint8_t *streams =
+            malloc(numChunks * max_compressed_size(LZ10_CHUNK_SIZE));
+        size_t *counts = malloc(numChunks * sizeof(*counts));
+        if (!streams || !counts) {
+            free(streams);
+            free(counts);
+            return -1;
+        }
+
+        free(c->streams);
+        free(c->counts);
+        c->streams = streams;
+        c->counts = counts;
+        c->chunkCap = numChunks;
+    }
+
+    c->src = src;
+    c->start = start;
+    c->end = end;
+    parallel_for(c->numThreads, numChunks, compress_chunk, c);
+
+    // stitch the chunks into a single stream
+    for (size_t i = 0; i < numChunks; ++i) {
+        if (c->counts[i] == SIZE_MAX)
+            return -1;
+        tw_append(tw, c->streams + i * max_compressed_size(LZ10_CHUNK_SIZE),
+                  c->counts[i]);
+    }
+
+    return 0;
+}
+
+/*
+ * Compress src into out, which must hold max_compressed_size(srcSize) bytes.
+ * Inputs larger than LZ10_CHUNK_SIZE are split into chunks when 'chunked' is
+ * set. Return the compressed size, or 0 on failure.
+ */
+static size_t compress_into(LZ10Compressor *c, const uint8_t *src,
+                            size_t srcSize, uint8_t *out, int chunked) {
+    write_header(out, srcSize);
+
+    TokenWriter tw;
+    tw_init(&tw, out + 4);
+
+    EncoderScratch *es = &c->scratch[0];
+    int err = chunked && srcSize
+                  ? encode_chunks(c, src, 0, srcSize, &tw)
+                  : encode_range(es, c->level, src, 0, srcSize, &tw);
+
+    return err ? 0 : (size_t)(tw.pak - out);
+}
+
+/*
+ * Compress a buffer with a context, splitting inputs larger than 512 KiB into
+ * chunks like lz10_compress_mt. The returned buffer belongs to the context and
+ * stays valid until the next call or until the context is destroyed.
+ */
+const uint8_t *lz10_compressor_compress(LZ10Compressor *c, const uint8_t *src,
+                                        size_t srcSize, size_t *outSize) {
+    if (!c || check_input("lz10_compressor_compress", src, srcSize, outSize))
+        return NULL;
+
+    size_t need = max_compressed_size(srcSize);
+    if (need > c->outCap) {
+        uint8_t *buf = realloc(c->out, need);
+        if (!buf) {
+            fprintf(stderr,
+                    "lz10_compressor_compress: memory allocation failed\n");
+            return NULL;
+        }
+        c->out = buf;
+        c->outCap = need;
+    }
+
+    size_t n = compress_into(c, src, srcSize, c->out, 1);
+    if (!n) {
+        fprintf(stderr, "lz10_compressor_compress: memory allocation failed\n");
+        return NULL;
+    }
+
+    *outSize = n;
+    return c->out;
+}
+
+/*
+ * Incremental encoder. The input is buffered behind the last 0x1000 bytes
+ * already encoded and compressed one batch of chunks at a time, exactly as
+ * lz10_compress_mt would chunk the whole buffer.
+ */
+struct LZ10Encoder {
+    LZ10Compressor *c; // level, threads and chunk buffers
+    uint8_t *in;       // window followed by the pending input
+    size_t inCap;      // LZ10_WINDOW plus one chunk per thread
+    size_t inFill;     // bytes held in 'in'
+    size_t histLen;    // window bytes at the start of 'in'
+    uint8_t *out;      // symbols not yet passed to the sink
+    TokenWriter tw;    // writes into 'out'
+    size_t total;      // input size given to lz10_encoder_begin
+    size_t fed;        // input bytes received so far
+    size_t written;    // bytes passed to the sink
+    LZ10Sink sink;     // output callback
+    void *user;        // sink argument
+};
+
+/*
+ * Create an incremental encoder for the given level, compressing each batch
+ * of chunks on up to numThreads threads.
+ */
+LZ10Encoder *lz10_encoder_create(int level, unsigned numThreads) {
+    LZ10Compressor *c = lz10_compressor_create(level, numThreads);
+    if (!c)
+        return NULL;
+
+    LZ10Encoder *e = calloc(1, sizeof(*e));
+    if (e) {
+        size_t batch = (size_t)c->numThreads * LZ10_CHUNK_SIZE;
+        e->c = c;
+        e->inCap = LZ10_WINDOW + batch;
+        e->in = malloc(e->inCap);
+        // leave room for a partial flag group carried over from the last batch
+        e->out = malloc(max_compressed_size(batch) + 16);
+    }
+
+    if (!e || !e->in || !e->out) {
+        fprintf(stderr, "lz10_encoder_create: memory allocation failed\n");
+        if (e)
+            lz10_encoder_destroy(e);
+        else
+            lz10_compressor_destroy(c);
+        return NULL;
+    }
+
+    return e;
+}
+
+/*
+ * Start a new stream of totalSize input bytes. The LZ10 header is passed to
+ * the sink right away.
+ */
+int lz10_encoder_begin(LZ10Encoder *e, size_t totalSize, LZ10Sink sink,
+                       void *user) {
+    if (!e || !sink) {
+        fprintf(stderr, "lz10_encoder_begin: invalid arguments\n");
+        return -1;
+    }
+
+    if (totalSize > 0xFFFFFF) {
+        fprintf(stderr, "lz10_encoder_begin: input too large (%zu bytes)\n",
+                totalSize);
+        return -1;
+    }
+
+    e->inFill = 0;
+    e->histLen = 0;
+    e->total = totalSize;
+    e->fed = 0;
+    e->written = 0;
+    e->sink = sink;
+    e->user = user;
+    tw_init(&e->tw, e->out);
+
+    uint8_t header[4];
+    write_header(header, totalSize);
+    if (sink(user, header, sizeof(header)) != 0) {
+        fprintf(stderr, "lz10_encoder_begin: output failed\n");
+        return -1;
+    }
+
+    e->written = sizeof(header);
+    return 0;
+}
+
+/*
+ * Encode the pending input and pass every complete flag group to the sink, or
+ * everything when 'final' is set. Keep the last 0x1000 input bytes as window.
+ */
+static int encoder_flush(LZ10Encoder *e, int final) {
+    if (e->inFill > e->histLen &&
+        encode_chunks(e->c, e->in, e->histLen, e->inFill, &e->tw) != 0) {
+        fprintf(stderr, "lz10_encoder: memory allocation failed\n");
+        return -1;
+    }
+
+    // a flag byte can only be written out once its group is complete
+    uint8_t *keep = final || e->tw.mask <= 1 ? e->tw.pak : e->tw.flagp;
+    size_t n = (size_t)(keep - e->out);
+    if (n && e->sink(e->user, e->out, n) != 0) {
+        fprintf(stderr, "lz10_encoder: output failed\n");
+        return -1;
+    }
+    e->written += n;
+
+    size_t rest = (size_t)(e->tw.pak - keep);
+    memmove(e->out, keep, rest);
+    e->tw.flagp = e->out;
+    e->tw.pak = e->out + rest;
+
+    size_t hist = e->inFill < LZ10_WINDOW ? e->inFill : LZ10_WINDOW;
+    memmove(e->in, e->in + e->inFill - hist, hist);
+    e->histLen = hist;
+    e->inFill = hist;
+    return 0;
+}
+
+/*
+ * Feed the next size bytes of input. Compressed data is passed to the sink as
+ * soon as a batch of chunks is complete.
+ */
+int lz10_encoder_feed(LZ10Encoder *e, const uint8_t *data, size_t size) {
+    if (!e || (!data && size)) {
+        fprintf(stderr, "lz10_encoder_feed: invalid arguments\n");
+        return -1;
+    }
+
+    if (size > e->total - e->fed) {
+        fprintf(stderr, "lz10_encoder_feed: more input than announced\n");
+        return -1;
+    }
+
+    // batches start on chunk boundaries, so that the output does not depend
+    // on how the input was split
+    size_t limit = e->histLen + (e->inCap - LZ10_WINDOW);
+
+    while (size) {
+        size_t n = limit - e->inFill;
+        if (n > size)
+            n = size;
+
+        memcpy(e->in + e->inFill, data, n);
+        e->inFill += n;
+        e->fed += n;
+        data += n;
+        size -= n;
+
+        if (e->inFill == limit) {
+            if (encoder_flush(e, 0) != 0)
+                return -1;
+            limit = e->histLen + (e->inCap - LZ10_WINDOW);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Encode the remaining input and pass it to the sink. Fail if less input was
+ * fed than announced. Store the total compressed size, header included, in
+ * outSize.
+ */
+int lz10_encoder_finish(LZ10Encoder *e, size_t *outSize) {
+    if (!e || !outSize) {
+        fprintf(stderr, "lz10_encoder_finish: invalid arguments\n");
+        return -1;
+    }
+
+    if (e->fed != e->total) {
+        fprintf(stderr,
+                "lz10_encoder_finish: got %zu bytes of input, expected %zu\n",
+                e->fed, e->total);
+        return -1;
+    }
+
+    if (encoder_flush(e, 1) != 0)
+        return -1;
+
+    *outSize = e->written;
+    return 0;
+}
+
+/*
+ * Release an incremental encoder and every buffer it owns.
+ */
+void lz10_encoder_destroy(LZ10Encoder *e) {
+    if (!e)
+        return;
+
+    lz10_compressor_destroy(e->c);
+    free(e->in);
+    free(e->out);
+    free(e);
+}
+
+/*
+ * Compress with a temporary context into a newly allocated buffer.
+ */
+static uint8_t *compress_alloc(const char *fn, const uint8_t *src,
+                               size_t srcSize, int level, unsigned numThreads,
+                               int chunked, size_t *outSize) {
+    if (check_input(fn, src, srcSize, outSize))
+        return NULL;
+
+    LZ10Compressor *c = lz10_compressor_create(level, numThreads);
+    if (!c)
+        return NULL;
+
+    uint8_t *out = malloc(max_compressed_size(srcSize));
+    size_t n = out ? compress_into(c, src, srcSize, out, chunked) : 0;
+    lz10_compressor_destroy(c);
+
+    if (!n) {
+        fprintf(stderr, "%s: memory allocation failed\n", fn);
+        free(out);
+        return NULL;
+    }
+
+    *outSize = n;
+    return out;
+}
+
+/*
+ * Compress a buffer using an LZ10 encoder. Use a greedy longest-match search
+ * within a sliding window of up to 0x1000 bytes, with a maximum match length
+ * of 0x12 bytes. Candidates are found through hash chains keyed on 3-byte
+ * prefixes.
+ */
+uint8_t *lz10_compress(const uint8_t *src, size_t srcSize, size_t *outSize) {
+    return lz10_compress_level(src, srcSize, LZ10_LEVEL_DEFAULT, outSize);
+}
+
+/*
+ * Compress a buffer using the search strategy of the given level, from
+ * LZ10_LEVEL_MIN (fastest) to LZ10_LEVEL_MAX (smallest output).
+ */
+uint8_t *lz10_compress_level(const uint8_t *src, size_t srcSize, int level,
+                             size_t *outSize) {
+    return compress_alloc("lz10_compress_level", src, srcSize, level, 1, 0,
+                          outSize);
+}
+
+/*
+ * Compress a buffer into the smallest possible LZ10 stream, using an optimal
+ * parse over every match candidate instead of a greedy search.
+ */
+uint8_t *lz10_compress_optimal(const uint8_t *src, size_t srcSize,
+                               size_t *outSize) {
+    return compress_alloc("lz10_compress_optimal", src, srcSize,
+                          LZ10_LEVEL_MAX, 1, 0, outSize);
+}
+
+/*
+ * Compress a buffer like lz10_compress_level, splitting large inputs into
+ * chunks encoded on up to numThreads threads.
+ */
+uint8_t *lz10_compress_mt(const uint8_t *src, size_t srcSize, int level,
+                          unsigned numThreads, size_t *outSize) {
+    return compress_alloc("lz10_compress_mt", src, srcSize, level, numThreads,
+                          1, outSize);
+}
+
+/*
+ * Estimate the compressed size of a buffer by encoding its first
+ * LZ10_SAMPLE_SIZE bytes at LZ10_LEVEL_MIN and extrapolating to the whole
+ * buffer.
+ */
+size_t lz10_estimate_size(const uint8_t *src, size_t srcSize) {
+    size_t sample = srcSize < LZ10_SAMPLE_SIZE ? srcSize : LZ10_SAMPLE_SIZE;
+    if (!src || sample == 0)
+        return max_compressed_size(srcSize);
+
+    size_t sampleOut = 0;
+    LZ10Compressor *c = lz10_compressor_create(LZ10_LEVEL_MIN, 1);
+    if (!c || !lz10_compressor_compress(c, src, sample, &sampleOut))
+        sampleOut = 0;
+    lz10_compressor_destroy(c);
+
+    if (!sampleOut)
+        return max_compressed_size(srcSize);
+
+    // extrapolate the symbol stream, not the 4-byte header
+    return 4 +
+           (size_t)((unsigned long long)(sampleOut - 4) * srcSize / sample);
 }
@@ -7,14 +7,17 @@
  */
 
 #include <ctype.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 
 #ifdef _WIN32
 #include <direct.h>
+#include <fcntl.h>
 #include <io.h>
 #include <windows.h>
 #else
@@ -23,9 +26,41 @@
 #include <unistd.h>
 #endif
 
+#include "filebatch.h"
 #include "lz10.h"
+#include "thread.h"
 #include "utils.h"
 
+/*
+ * Default minimum saving, in percent, for "auto" entries to be stored
+ * compressed.
+ */
+#define DEFAULT_AUTO_MARGIN 5
+
+/*
+ * Size of the blocks entry files are read in while building. Must be at least
+ * LZ10_SAMPLE_SIZE.
+ */
+#define PACK_BLOCK_SIZE 0x10000
+
+/*
+ * Largest entry the build pipeline holds in memory. Larger entries are packed
+ * by the writer as a stream, their chunks compressed on every thread.
+ */
+#define PIPE_MAX_ENTRY 0x80000
+
+/*
+ * Entries the build pipeline may read ahead of the writer, per job. Memory
+ * use is bounded by this window of PIPE_MAX_ENTRY-sized entries.
+ */
+#define PIPE_WINDOW_PER_JOB 4
+
+/*
+ * File recording, in an extraction directory, which archive it was extracted
+ * from.
+ */
+#define STAMP_NAME ".acfstamp"
+
 typedef struct {
     char magic[4];       // "acf\0"
     uint32_t headerSize; // usually 0x20
@@ -54,12 +89,17 @@ static void make_index_name(char *dst, size_t dstSize, uint32_t index,
 
 /*
  * Derive the output directory name from an archive path by stripping the file
- * extension.
+ * extension. An archive read from stdin ("-") is extracted into "stdin".
  */
 static void make_outdir(char *dst, size_t dstSize, const char *path) {
     if (!dst || dstSize == 0)
         return;
 
+    if (path && !strcmp(path, "-")) {
+        snprintf(dst, dstSize, "stdin");
+        return;
+    }
+
     snprintf(dst, dstSize, "%s", path ? path : "");
 
     char *dot = strrchr(dst, '.'); // find the last dot to locate the extension
@@ -116,13 +156,30 @@ static int set_meta_bin_name(char **metaNames, uint32_t count, uint32_t index) {
 }
 
 /*
- * Release all resources allocated during an extract operation.
+ * What each extraction worker keeps across entries.
+ */
+typedef struct {
+    LZ10Decoder *dec; // streaming decoder for large entries
+    FileBatch *batch; // small output files, NULL unless --io-uring
+} WorkerScratch;
+
+/*
+ * Release all resources allocated during an extract operation. Queued small
+ * files are written before the archive they may point into is unmapped.
  */
-static void cleanup_extract(uint8_t *fileData, char **metaNames,
+static void cleanup_extract(MappedFile *archive, WorkerScratch *scratch,
+                            unsigned numWorkers, char **metaNames,
                             int *metaStates, uint32_t numFiles) {
+    if (scratch) {
+        for (unsigned w = 0; w < numWorkers; ++w) {
+            file_batch_destroy(scratch[w].batch);
+            lz10_decoder_destroy(scratch[w].dec);
+        }
+        free(scratch);
+    }
     free_string_array(metaNames, numFiles);
     free(metaStates);
-    free(fileData);
+    unmap_file(archive);
 }
 
 /*
@@ -130,11 +187,12 @@ static void cleanup_extract(uint8_t *fileData, char **metaNames,
  */
 static void cleanup_build(FILE *out, FATEntry *fat, char **files,
                           int *compressFlags, uint32_t numFiles,
-                          char **jsonNames, int *jsonStates,
-                          uint32_t jsonCount) {
+                          char **jsonNames, int *jsonStates, uint32_t jsonCount,
+                          LZ10Encoder *enc) {
     if (out)
         fclose(out);
     free(fat);
+    lz10_encoder_destroy(enc);
 
     if (files) {
         for (uint32_t i = 0; i < numFiles; ++i)
@@ -160,275 +218,2572 @@ static const char *path_basename(const char *path) {
             base = p + 1;
     }
 
-    return base;
+    return base;
+}
+
+/*
+ * Output file of an entry decoded on the fly.
+ */
+typedef struct {
+    const char *outdir; // extraction directory
+    uint32_t index;     // entry index
+    char relname[64];   // NNNN.ext name, set when the file is created
+    char outname[768];  // full path, set when the file is created
+    FILE *f;            // output file
+    int writeFailed;    // set when creating or writing the file failed
+    int incremental;    // leave an identical existing file alone
+    int unchanged;      // set when the existing file was left alone
+} EntryFile;
+
+/*
+ * Decoder sink writing an entry to its file.
+ */
+static int entry_file_sink(void *user, const uint8_t *data, size_t size) {
+    EntryFile *ef = user;
+
+    if (fwrite(data, 1, size, ef->f) != size) {
+        ef->writeFailed = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Decoder sink hashing an entry with hash64 instead of writing it.
+ */
+static int hash_sink(void *user, const uint8_t *data, size_t size) {
+    uint64_t *hash = user;
+    *hash = hash64(*hash, data, size);
+    return 0;
+}
+
+/*
+ * Check whether a file exists with the given size.
+ */
+static int file_has_size(const char *path, unsigned long long size) {
+    struct stat st;
+    return stat(path, &st) == 0 && (unsigned long long)st.st_size == size;
+}
+
+/*
+ * Decode an LZ10 entry straight into its file in the extraction directory.
+ * The file is named after its first bytes, which are decoded on their own
+ * first. On success, its NNNN.ext name is stored in ef->relname. A file left
+ * incomplete by a decoding error is removed. In incremental mode, an existing
+ * file of the same size is hashed against a decode of the entry and kept if
+ * they match.
+ */
+static int extract_lz10_entry(LZ10Decoder *dec, const uint8_t *src,
+                              size_t srcSize, EntryFile *ef) {
+    uint8_t head[4];
+    size_t headLen = 0;
+    if (lz10_decompress_prefix(src, srcSize, head, sizeof(head), &headLen) !=
+        0)
+        return EXIT_FAILURE;
+
+    char extBuf[16];
+    const char *ext = try_get_extension(head, headLen, 4, 2, "bin", extBuf,
+                                        sizeof(extBuf));
+    make_index_name(ef->relname, sizeof(ef->relname), ef->index, ext);
+    join_path(ef->outname, sizeof(ef->outname), ef->outdir, ef->relname);
+
+    size_t decSize = 0;
+    if (ef->incremental &&
+        file_has_size(ef->outname, lz10_peek_size(src, srcSize))) {
+        uint64_t hash = HASH64_INIT;
+        if (lz10_decoder_begin(dec, hash_sink, &hash) != 0 ||
+            lz10_decoder_feed(dec, src, srcSize) != 0 ||
+            lz10_decoder_finish(dec, &decSize) != 0) {
+            remove(ef->outname);
+            return EXIT_FAILURE;
+        }
+
+        if (file_matches(ef->outname, decSize, hash)) {
+            ef->unchanged = 1;
+            return EXIT_SUCCESS;
+        }
+    }
+
+    ef->f = xfopen(ef->outname, "wb");
+    if (!ef->f) {
+        ef->writeFailed = 1;
+        return EXIT_FAILURE;
+    }
+
+    int ok = lz10_decoder_begin(dec, entry_file_sink, ef) == 0 &&
+             lz10_decoder_feed(dec, src, srcSize) == 0 &&
+             lz10_decoder_finish(dec, &decSize) == 0;
+
+    if (fclose(ef->f) != 0) {
+        ef->writeFailed = 1;
+        ok = 0;
+    }
+    ef->f = NULL;
+
+    if (!ok && !ef->writeFailed)
+        remove(ef->outname);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * State shared by the workers extracting one archive. Names and states are
+ * stored by entry index, so filelist.json does not depend on the order in
+ * which entries complete.
+ */
+typedef struct {
+    const char *path;
+    const char *outdir;
+    const MappedFile *archive;
+    uint32_t dataStart;
+    uint32_t numFiles;
+    const FATEntry *entries;
+    char **metaNames;
+    int *metaStates;
+    WorkerScratch *scratch; // one per worker
+    int progress;           // print the progress line
+    int incremental;        // keep output files whose content is unchanged
+    Mutex lock;             // guards the counters and the progress line
+    uint32_t done;
+    uint32_t unchanged; // entries whose file was kept
+    int failed;         // set when memory runs out
+} ExtractJob;
+
+/*
+ * Record entry i as absent under a "NNNN.bin" name.
+ */
+static int mark_absent(ExtractJob *job, uint32_t i) {
+    job->metaStates[i] = -1;
+    return set_meta_bin_name(job->metaNames, job->numFiles, i);
+}
+
+/*
+ * Decode a small LZ10 entry into the batch of its worker and queue its file,
+ * named in relname. Return EXIT_FAILURE if the entry does not decode.
+ */
+static int queue_lz10_entry(FileBatch *batch, const uint8_t *src,
+                            size_t srcSize, size_t decSize, uint32_t i,
+                            char *relname, size_t relnameSize) {
+    uint8_t *dst = file_batch_buffer(batch, decSize);
+    size_t outSize = 0;
+    if (!dst || lz10_decompress_into(src, srcSize, dst, decSize, &outSize) != 0)
+        return EXIT_FAILURE;
+
+    char extBuf[16];
+    const char *ext = try_get_extension(dst, outSize, 4, 2, "bin", extBuf,
+                                        sizeof(extBuf));
+    make_index_name(relname, relnameSize, i, ext);
+    file_batch_add(batch, relname, dst, outSize);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Extract entry i of the archive with the scratch of the calling worker and
+ * record its name and state. Files of up to FILE_BATCH_MAX_SIZE bytes are
+ * queued in the worker's batch, larger ones written on their own. Damaged
+ * entries are reported and marked absent or saved raw; only a memory
+ * allocation failure is returned as an error. *unchanged is set when an
+ * identical file from an earlier extraction was kept.
+ */
+static int extract_entry(ExtractJob *job, uint32_t i, WorkerScratch *ws,
+                         int *unchanged) {
+    const FATEntry e = job->entries[i];
+    char extBuf[16];
+
+    // sentinel value marks an absent entry
+    if (e.relativeOffset == 0xFFFFFFFFu)
+        return mark_absent(job, i);
+
+    size_t dataOffset = (size_t)job->dataStart + (size_t)e.relativeOffset;
+    if (dataOffset >= job->archive->size) {
+        fprintf(stderr, "extract_acf: entry %u: offset out of range\n", i);
+        return mark_absent(job, i);
+    }
+
+    const uint8_t *src = job->archive->data + dataOffset;
+    size_t outSize = 0;
+    int compressed = 0; // decoded straight to its file when set
+
+    char relname[64];
+
+    if (e.inputSize > 0) { // the entry is compressed
+        if (dataOffset + (size_t)e.inputSize > job->archive->size) {
+            fprintf(stderr,
+                    "extract_acf: entry %u: compressed data exceeds file "
+                    "size\n",
+                    i);
+            return mark_absent(job, i);
+        }
+
+        outSize = (size_t)e.inputSize;
+
+        size_t decSize = lz10_peek_size(src, (size_t)e.inputSize);
+
+        if (src[0] == 0x10 && ws->batch && decSize > 0 &&
+            decSize <= FILE_BATCH_MAX_SIZE) {
+            if (queue_lz10_entry(ws->batch, src, (size_t)e.inputSize, decSize,
+                                 i, relname, sizeof(relname)) == EXIT_SUCCESS)
+                compressed = 1;
+            else
+                fprintf(stderr,
+                        "extract_acf: decompression failed for entry %u, "
+                        "saving raw\n",
+                        i);
+        } else if (src[0] == 0x10) { // LZ10 compression type byte
+            EntryFile ef = {.outdir = job->outdir,
+                            .index = i,
+                            .incremental = job->incremental};
+            if (extract_lz10_entry(ws->dec, src, (size_t)e.inputSize, &ef) ==
+                EXIT_SUCCESS) {
+                snprintf(relname, sizeof(relname), "%s", ef.relname);
+                compressed = 1;
+                *unchanged = ef.unchanged;
+            } else if (ef.writeFailed) {
+                fprintf(stderr, "extract_acf: failed writing %s\n",
+                        ef.outname);
+                snprintf(relname, sizeof(relname), "%s", ef.relname);
+                compressed = 1;
+            } else {
+                fprintf(stderr,
+                        "extract_acf: decompression failed for entry %u, "
+                        "saving raw\n",
+                        i);
+            }
+        }
+    } else { // inputSize == 0: the entry is uncompressed; use outputSize
+        if (dataOffset + (size_t)e.outputSize > job->archive->size) {
+            fprintf(stderr,
+                    "extract_acf: entry %u: raw data exceeds file size\n", i);
+            return mark_absent(job, i);
+        }
+
+        outSize = (size_t)e.outputSize;
+    }
+
+    // raw entries are copied straight from the archive
+    if (!compressed) {
+        const char *ext = try_get_extension(src, outSize, 4, 2, "bin", extBuf,
+                                            sizeof(extBuf));
+        make_index_name(relname, sizeof(relname), i, ext);
+
+        char outname[768];
+        join_path(outname, sizeof(outname), job->outdir, relname);
+
+        if (ws->batch && outSize <= FILE_BATCH_MAX_SIZE)
+            file_batch_add(ws->batch, relname, src, outSize);
+        else if (job->incremental && file_has_size(outname, outSize) &&
+            file_matches(outname, outSize,
+                         hash64(HASH64_INIT, src, outSize)))
+            *unchanged = 1;
+        else if (write_file_range(outname, job->archive, dataOffset,
+                                  outSize) != 0)
+            fprintf(stderr, "extract_acf: failed writing %s\n", outname);
+    }
+
+    job->metaStates[i] = compressed ? 1 : 0;
+    return set_meta_name(job->metaNames, job->numFiles, i, relname);
+}
+
+/*
+ * parallel_for callback: extract one entry and update the progress line.
+ */
+static void extract_worker(void *arg, size_t index, unsigned worker) {
+    ExtractJob *job = arg;
+
+    mutex_lock(&job->lock);
+    int failed = job->failed;
+    mutex_unlock(&job->lock);
+
+    // stop doing work once memory has run out
+    int unchanged = 0;
+    int rc = failed ? EXIT_FAILURE
+                    : extract_entry(job, (uint32_t)index,
+                                    &job->scratch[worker], &unchanged);
+
+    mutex_lock(&job->lock);
+    if (rc != EXIT_SUCCESS)
+        job->failed = 1;
+    job->unchanged += (uint32_t)unchanged;
+
+    // print progress every 32 entries and on the last one
+    uint32_t done = ++job->done;
+    if (job->progress && ((done & 31u) == 0 || done == job->numFiles)) {
+        printf("\r  %s: extracted %u/%u", path_basename(job->path), done,
+               job->numFiles);
+        fflush(stdout);
+    }
+    mutex_unlock(&job->lock);
+}
+
+/*
+ * What an extraction directory was extracted from, recorded in STAMP_NAME by
+ * incremental extractions.
+ */
+typedef struct {
+    unsigned long long size; // archive size
+    long long mtime;         // archive modification time
+    uint64_t fatHash;        // hash64 of the header and the FAT
+} ArchiveStamp;
+
+/*
+ * Check whether the stamp of an extraction directory matches an archive, and
+ * its filelist.json is still there.
+ */
+static int stamp_matches(const char *outdir, const ArchiveStamp *stamp) {
+    char name[768];
+    join_path(name, sizeof(name), outdir, "filelist.json");
+
+    struct stat st;
+    if (stat(name, &st) != 0)
+        return 0;
+
+    join_path(name, sizeof(name), outdir, STAMP_NAME);
+    if (stat(name, &st) != 0)
+        return 0;
+
+    FILE *f = xfopen(name, "r");
+    if (!f)
+        return 0;
+
+    ArchiveStamp old;
+    int n = fscanf(f, "%llu %lld %" SCNx64, &old.size, &old.mtime,
+                   &old.fatHash);
+    fclose(f);
+
+    return n == 3 && old.size == stamp->size && old.mtime == stamp->mtime &&
+           old.fatHash == stamp->fatHash;
+}
+
+/*
+ * Record the archive an extraction directory was extracted from.
+ */
+static int write_stamp(const char *outdir, const ArchiveStamp *stamp) {
+    char name[768];
+    join_path(name, sizeof(name), outdir, STAMP_NAME);
+
+    FILE *f = xfopen(name, "w");
+    if (!f)
+        return EXIT_FAILURE;
+
+    int ok = fprintf(f, "%llu %lld %016" PRIx64 "\n", stamp->size,
+                     stamp->mtime, stamp->fatHash) > 0;
+    return fclose(f) == 0 && ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Write filelist.json through a temporary file, and only replace the existing
+ * one if its content changed.
+ */
+static int write_filelist_if_changed(const char *metafile, char **names,
+                                     const int *states, uint32_t count) {
+    char tmpfile[800];
+    snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", metafile);
+
+    if (write_json_file_states(tmpfile, names, states, count) != 0)
+        return EXIT_FAILURE;
+
+    size_t size = 0;
+    uint8_t *data = read_file(tmpfile, &size);
+    int same = data && file_matches(metafile, size,
+                                    hash64(HASH64_INIT, data, size));
+    free(data);
+
+    if (same)
+        return remove(tmpfile) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    remove(metafile); // rename does not replace files on Windows
+    return rename(tmpfile, metafile) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Extract all files from an ACF archive into a sibling directory with the same
+ * name minus the extension, decoding entries on up to 'jobs' threads. The
+ * per-entry progress line is printed when 'progress' is set. In incremental
+ * mode, nothing is written if the directory was extracted from the same
+ * archive, and otherwise only the files whose content differs are. With
+ * 'ioUring', small files are written in batches through a FileBatch.
+ */
+static int extract_acf(const char *path, unsigned jobs, int progress,
+                       int incremental, int ioUring) {
+    if (!path)
+        return EXIT_FAILURE;
+
+    // entry data is read in place from the mapping
+    MappedFile archive;
+    if (map_file(path, &archive) != EXIT_SUCCESS) {
+        fprintf(stderr, "extract_acf: cannot read %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    const uint8_t *fileData = archive.data;
+    size_t fileSize = archive.size;
+
+    if (fileSize < sizeof(ACFHeader)) {
+        fprintf(stderr, "extract_acf: %s is too small to be an ACF\n", path);
+        unmap_file(&archive);
+        return EXIT_FAILURE;
+    }
+
+    ACFHeader hdr;
+    memcpy(&hdr, fileData, sizeof(hdr));
+
+    if (memcmp(hdr.magic, "acf", 3) != 0) {
+        fprintf(stderr, "extract_acf: %s does not have an 'acf\\0' header\n",
+                path);
+        unmap_file(&archive);
+        return EXIT_FAILURE;
+    }
+
+    size_t fatOffset = hdr.headerSize;
+    if (fatOffset > fileSize ||
+        hdr.numFiles > (fileSize - fatOffset) / sizeof(FATEntry)) {
+        fprintf(stderr, "extract_acf: FAT table in %s exceeds file size\n",
+                path);
+        unmap_file(&archive);
+        return EXIT_FAILURE;
+    }
+
+    const FATEntry *entries = (const FATEntry *)(fileData + fatOffset);
+
+    char outdir[512];
+    make_outdir(outdir, sizeof(outdir), path);
+
+    ArchiveStamp stamp = {0};
+    if (incremental) {
+        struct stat st;
+        if (stat(path, &st) == 0) {
+            stamp.size = (unsigned long long)st.st_size;
+            stamp.mtime = (long long)st.st_mtime;
+        }
+        stamp.fatHash = hash64(HASH64_INIT, fileData,
+                               fatOffset + hdr.numFiles * sizeof(FATEntry));
+
+        if (stamp_matches(outdir, &stamp)) {
+            if (progress)
+                printf("  %s: up to date\n", path_basename(path));
+            unmap_file(&archive);
+            return EXIT_SUCCESS;
+        }
+    }
+
+    // extract_acf will fail naturally if the dir is unusable
+    (void)mkdir_dir(outdir);
+
+    // allocate at least 1 element to avoid passing zero to calloc
+    char **metaNames =
+        calloc(hdr.numFiles ? hdr.numFiles : 1, sizeof(*metaNames));
+    int *metaStates =
+        calloc(hdr.numFiles ? hdr.numFiles : 1, sizeof(*metaStates));
+    if (!metaNames || !metaStates) {
+        fprintf(stderr, "extract_acf: memory allocation failed\n");
+        cleanup_extract(&archive, NULL, 0, metaNames, metaStates,
+                        hdr.numFiles);
+        return EXIT_FAILURE;
+    }
+
+    // one scratch per worker, never more workers than entries
+    unsigned numWorkers = jobs;
+    if (numWorkers > hdr.numFiles)
+        numWorkers = hdr.numFiles ? hdr.numFiles : 1;
+
+    WorkerScratch *scratch = calloc(numWorkers, sizeof(*scratch));
+    if (!scratch) {
+        fprintf(stderr, "extract_acf: memory allocation failed\n");
+        cleanup_extract(&archive, NULL, 0, metaNames, metaStates,
+                        hdr.numFiles);
+        return EXIT_FAILURE;
+    }
+
+    // incremental extractions compare files one by one instead of batching
+    int batched = ioUring && !incremental;
+    for (unsigned w = 0; w < numWorkers; ++w) {
+        scratch[w].dec = lz10_decoder_create();
+        if (batched && scratch[w].dec)
+            scratch[w].batch = file_batch_create(outdir);
+        if (!scratch[w].dec || (batched && !scratch[w].batch)) {
+            cleanup_extract(&archive, scratch, numWorkers, metaNames,
+                            metaStates, hdr.numFiles);
+            return EXIT_FAILURE;
+        }
+    }
+
+    ExtractJob job = {
+        .path = path,
+        .outdir = outdir,
+        .archive = &archive,
+        .dataStart = hdr.dataStart,
+        .numFiles = hdr.numFiles,
+        .entries = entries,
+        .metaNames = metaNames,
+        .metaStates = metaStates,
+        .scratch = scratch,
+        .progress = progress,
+        .incremental = incremental,
+    };
+
+    if (mutex_init(&job.lock) != 0) {
+        fprintf(stderr, "extract_acf: cannot create mutex\n");
+        cleanup_extract(&archive, scratch, numWorkers, metaNames, metaStates,
+                        hdr.numFiles);
+        return EXIT_FAILURE;
+    }
+
+    parallel_for(numWorkers, hdr.numFiles, extract_worker, &job);
+    mutex_destroy(&job.lock);
+
+    if (progress)
+        printf("\n");
+
+    // failures are reported by the flush and leave the entry's state alone
+    for (unsigned w = 0; w < numWorkers; ++w) {
+        if (scratch[w].batch)
+            (void)file_batch_flush(scratch[w].batch);
+    }
+
+    if (job.failed) {
+        fprintf(stderr, "extract_acf: memory allocation failed\n");
+        cleanup_extract(&archive, scratch, numWorkers, metaNames, metaStates,
+                        hdr.numFiles);
+        return EXIT_FAILURE;
+    }
+
+    char metafile[768];
+    join_path(metafile, sizeof(metafile), outdir, "filelist.json");
+
+    int written =
+        incremental ? write_filelist_if_changed(metafile, metaNames, metaStates,
+                                                hdr.numFiles)
+                    : write_json_file_states(metafile, metaNames, metaStates,
+                                             hdr.numFiles);
+    if (written != 0) {
+        fprintf(stderr, "extract_acf: cannot create metadata file %s\n",
+                metafile);
+        cleanup_extract(&archive, scratch, numWorkers, metaNames, metaStates,
+                        hdr.numFiles);
+        return EXIT_FAILURE;
+    }
+
+    if (incremental) {
+        if (progress)
+            printf("  %s: %u entries unchanged\n", path_basename(path),
+                   job.unchanged);
+        if (write_stamp(outdir, &stamp) != EXIT_SUCCESS)
+            fprintf(stderr, "extract_acf: cannot write the stamp of %s\n",
+                    outdir);
+    }
+
+    cleanup_extract(&archive, scratch, numWorkers, metaNames, metaStates,
+                    hdr.numFiles);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Read the header and the FAT of an open archive with read_file_at, leaving
+ * the entry data alone. Return NULL on success, or a short description of the
+ * problem.
+ */
+static const char *read_fat(FILE *in, ACFHeader *hdr, FATEntry **outFat,
+                            long long *outSize) {
+    *outFat = NULL;
+
+    long long fileSize = file_size(in);
+    if (fileSize < (long long)sizeof(*hdr) ||
+        read_file_at(in, 0, hdr, sizeof(*hdr)) != EXIT_SUCCESS)
+        return "file too small to be an ACF";
+
+    if (memcmp(hdr->magic, "acf", 3) != 0)
+        return "missing 'acf' magic";
+
+    if ((long long)hdr->headerSize > fileSize ||
+        hdr->numFiles > (unsigned long long)(fileSize - hdr->headerSize) /
+                            sizeof(FATEntry))
+        return "FAT exceeds file size";
+
+    // allocate at least 1 element to avoid passing zero to malloc
+    FATEntry *fat = malloc((hdr->numFiles ? hdr->numFiles : 1) * sizeof(*fat));
+    if (!fat)
+        return "memory allocation failed";
+
+    if (read_file_at(in, hdr->headerSize, fat,
+                     hdr->numFiles * sizeof(*fat)) != EXIT_SUCCESS) {
+        free(fat);
+        return "cannot read the FAT";
+    }
+
+    *outFat = fat;
+    *outSize = fileSize;
+    return NULL;
+}
+
+/*
+ * What the first bytes of an entry tell about it.
+ */
+typedef struct {
+    uint8_t head[16]; // first stored bytes, enough to decode a 4-byte magic
+    size_t headLen;
+    int compressed; // LZ10 data whose first bytes decode
+    size_t decSize; // size declared by the LZ10 header
+    char extBuf[16];
+    const char *ext; // sniffed extension
+} EntrySniff;
+
+/*
+ * Read the first bytes of an entry stored at 'offset' and sniff its extension,
+ * decoding them first if the FAT marks the entry as compressed.
+ */
+static int sniff_entry(FILE *in, long long offset, size_t size,
+                       int fatCompressed, EntrySniff *s) {
+    uint8_t magic[4];
+    size_t magicLen = 0;
+
+    s->headLen = size < sizeof(s->head) ? size : sizeof(s->head);
+    if (read_file_at(in, offset, s->head, s->headLen) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    s->compressed =
+        fatCompressed && s->headLen > 0 && s->head[0] == 0x10 &&
+        lz10_decompress_prefix(s->head, s->headLen, magic, sizeof(magic),
+                               &magicLen) == 0;
+    s->decSize = s->compressed ? lz10_peek_size(s->head, s->headLen) : 0;
+
+    if (s->compressed)
+        s->ext = try_get_extension(magic, magicLen, 4, 2, "bin", s->extBuf,
+                                   sizeof(s->extBuf));
+    else
+        s->ext = try_get_extension(s->head, s->headLen, 4, 2, "bin",
+                                   s->extBuf, sizeof(s->extBuf));
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Range of entry indices picked with --only.
+ */
+typedef struct {
+    uint32_t first;
+    uint32_t last;
+} IndexRange;
+
+/*
+ * Entries picked with --only and --ext.
+ */
+typedef struct {
+    IndexRange *ranges; // NULL selects every index
+    uint32_t numRanges;
+    const char *ext; // sniffed extension to keep, or NULL for any
+} EntrySelection;
+
+/*
+ * Parse a list of indices and ranges such as "12,40-45" into sel->ranges.
+ */
+static int parse_index_list(const char *s, EntrySelection *sel) {
+    uint32_t cap = 0;
+
+    for (;;) {
+        char *end = NULL;
+        if (!isdigit((unsigned char)*s))
+            return EXIT_FAILURE;
+        unsigned long first = strtoul(s, &end, 10);
+        unsigned long last = first;
+        if (*end == '-') {
+            s = end + 1;
+            if (!isdigit((unsigned char)*s))
+                return EXIT_FAILURE;
+            last = strtoul(s, &end, 10);
+        }
+
+        if (first > last || last > UINT32_MAX)
+            return EXIT_FAILURE;
+
+        if (sel->numRanges == cap) {
+            cap = cap ? cap * 2 : 8;
+            IndexRange *grown = realloc(sel->ranges, cap * sizeof(*grown));
+            if (!grown)
+                return EXIT_FAILURE;
+            sel->ranges = grown;
+        }
+        sel->ranges[sel->numRanges].first = (uint32_t)first;
+        sel->ranges[sel->numRanges].last = (uint32_t)last;
+        sel->numRanges++;
+
+        if (*end == '\0')
+            return EXIT_SUCCESS;
+        if (*end != ',')
+            return EXIT_FAILURE;
+        s = end + 1;
+    }
+}
+
+/*
+ * Check whether an entry index is picked by --only.
+ */
+static int index_selected(const EntrySelection *sel, uint32_t i) {
+    if (!sel->ranges)
+        return 1;
+
+    for (uint32_t r = 0; r < sel->numRanges; ++r) {
+        if (i >= sel->ranges[r].first && i <= sel->ranges[r].last)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Decoder sink for stream_range, feeding archive bytes to a decoder.
+ */
+static int decoder_feed_sink(void *user, const uint8_t *data, size_t size) {
+    return lz10_decoder_feed(user, data, size);
+}
+
+/*
+ * Read 'size' bytes of an archive from 'offset' in blocks and pass them to a
+ * sink.
+ */
+static int stream_range(FILE *in, long long offset, size_t size, uint8_t *buf,
+                        LZ10Sink sink, void *user) {
+    while (size > 0) {
+        size_t n = size < PACK_BLOCK_SIZE ? size : PACK_BLOCK_SIZE;
+        if (read_file_at(in, offset, buf, n) != EXIT_SUCCESS) {
+            fprintf(stderr, "stream_range: read failed at offset %lld\n",
+                    offset);
+            return EXIT_FAILURE;
+        }
+
+        if (sink(user, buf, n) != 0)
+            return EXIT_FAILURE;
+
+        offset += (long long)n;
+        size -= n;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Write one selected entry, decoded if 'compressed' is set, to its NNNN.ext
+ * file in ef->outdir, or to stdout when ef->outdir is NULL. Set *decodeFailed
+ * when only the LZ10 data was at fault, so that the caller can save it raw.
+ */
+static int write_selected_entry(FILE *in, long long offset, size_t size,
+                                int compressed, const char *ext, EntryFile *ef,
+                                LZ10Decoder *dec, uint8_t *buf,
+                                int *decodeFailed) {
+    *decodeFailed = 0;
+
+    if (ef->outdir) {
+        make_index_name(ef->relname, sizeof(ef->relname), ef->index, ext);
+        join_path(ef->outname, sizeof(ef->outname), ef->outdir, ef->relname);
+        ef->f = xfopen(ef->outname, "wb");
+        if (!ef->f) {
+            fprintf(stderr, "extract_acf: failed writing %s\n", ef->outname);
+            return EXIT_FAILURE;
+        }
+    } else {
+        snprintf(ef->outname, sizeof(ef->outname), "standard output");
+        ef->f = stdout;
+    }
+
+    int ok;
+    if (compressed) {
+        size_t decSize = 0;
+        ok = lz10_decoder_begin(dec, entry_file_sink, ef) == 0 &&
+             stream_range(in, offset, size, buf, decoder_feed_sink, dec) ==
+                 EXIT_SUCCESS &&
+             lz10_decoder_finish(dec, &decSize) == 0;
+    } else {
+        ok = stream_range(in, offset, size, buf, entry_file_sink, ef) ==
+             EXIT_SUCCESS;
+    }
+
+    if (ef->outdir && fclose(ef->f) != 0) {
+        ef->writeFailed = 1;
+        ok = 0;
+    }
+    ef->f = NULL;
+
+    if (ok)
+        return EXIT_SUCCESS;
+
+    if (ef->writeFailed) {
+        fprintf(stderr, "extract_acf: failed writing %s\n", ef->outname);
+    } else if (compressed) {
+        *decodeFailed = 1;
+        if (ef->outdir)
+            remove(ef->outname);
+    }
+
+    return EXIT_FAILURE;
+}
+
+/*
+ * Extract only the entries picked by 'sel' from an ACF archive, into the same
+ * directory as a full extraction or, when 'toStdout' is set, one after the
+ * other to stdout. Only the header, the FAT and the selected entries are read,
+ * so the cost does not depend on the size of the archive. No filelist.json is
+ * written.
+ */
+static int extract_selected(const char *path, const EntrySelection *sel,
+                            int toStdout) {
+    FATEntry *fat = NULL;
+    LZ10Decoder *dec = NULL;
+    uint8_t *buf = NULL;
+    int status = EXIT_FAILURE;
+
+    FILE *in = xfopen(path, "rb");
+    if (!in) {
+        fprintf(stderr, "extract_acf: cannot read %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    long long fileSize = 0;
+    ACFHeader hdr;
+    const char *error = read_fat(in, &hdr, &fat, &fileSize);
+    if (error) {
+        fprintf(stderr, "extract_acf: %s: %s\n", path, error);
+        goto done;
+    }
+
+    dec = lz10_decoder_create();
+    buf = malloc(PACK_BLOCK_SIZE);
+    if (!dec || !buf) {
+        fprintf(stderr, "extract_acf: memory allocation failed\n");
+        goto done;
+    }
+
+    char outdir[512];
+    if (!toStdout) {
+        make_outdir(outdir, sizeof(outdir), path);
+        (void)mkdir_dir(outdir);
+    }
+
+#ifdef _WIN32
+    if (toStdout)
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+    uint32_t matched = 0, written = 0, failed = 0;
+    for (uint32_t i = 0; i < hdr.numFiles; ++i) {
+        const FATEntry e = fat[i];
+        if (!index_selected(sel, i) || e.relativeOffset == 0xFFFFFFFFu)
+            continue;
+
+        long long offset = (long long)hdr.dataStart + e.relativeOffset;
+        size_t size = e.inputSize ? e.inputSize : e.outputSize;
+        if (offset >= fileSize || (long long)size > fileSize - offset) {
+            fprintf(stderr, "extract_acf: entry %u: data exceeds file size\n",
+                    i);
+            failed++;
+            continue;
+        }
+
+        EntrySniff sniff;
+        if (sniff_entry(in, offset, size, e.inputSize > 0, &sniff) !=
+            EXIT_SUCCESS) {
+            fprintf(stderr, "extract_acf: entry %u: read failed\n", i);
+            failed++;
+            continue;
+        }
+
+        const char *ext = sniff.ext;
+        if (sel->ext && strcasecmp(ext, sel->ext) != 0)
+            continue;
+
+        matched++;
+
+        EntryFile ef = {.outdir = toStdout ? NULL : outdir, .index = i};
+        int decodeFailed = 0;
+        int rc = write_selected_entry(in, offset, size, sniff.compressed, ext,
+                                      &ef, dec, buf, &decodeFailed);
+
+        // like a full extraction, keep undecodable entries as raw files
+        if (rc != EXIT_SUCCESS && decodeFailed && !toStdout) {
+            fprintf(stderr,
+                    "extract_acf: decompression failed for entry %u, saving "
+                    "raw\n",
+                    i);
+            char extBuf[16];
+            ext = try_get_extension(sniff.head, sniff.headLen, 4, 2, "bin",
+                                    extBuf, sizeof(extBuf));
+            EntryFile raw = {.outdir = outdir, .index = i};
+            rc = write_selected_entry(in, offset, size, 0, ext, &raw, dec, buf,
+                                      &decodeFailed);
+        }
+
+        if (rc == EXIT_SUCCESS)
+            written++;
+        else
+            failed++;
+    }
+
+    if (toStdout && fflush(stdout) != 0) {
+        fprintf(stderr, "extract_acf: failed writing standard output\n");
+        failed++;
+    }
+
+    if (matched == 0) {
+        fprintf(stderr, "extract_acf: no entry of %s matches the selection\n",
+                path);
+    } else {
+        if (!toStdout)
+            printf("  %s: extracted %u entries\n", path_basename(path),
+                   written);
+        status = failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+done:
+    fclose(in);
+    free(fat);
+    free(buf);
+    lz10_decoder_destroy(dec);
+    return status;
+}
+
+/*
+ * Sequential ustar writer for --tar. Every member is stored under the same
+ * directory and with the same modification time.
+ */
+typedef struct {
+    FILE *f;
+    const char *dir; // directory of every member
+    long long mtime; // modification time of every member
+} TarWriter;
+
+/*
+ * Write the 512-byte ustar header of a member: a regular file 'name' of 'size'
+ * bytes in the directory, or the directory itself when name is NULL.
+ */
+static int tar_header(TarWriter *t, const char *name, unsigned long long size) {
+    char h[512];
+    memset(h, 0, sizeof(h));
+
+    // the directory goes in the prefix field, so names stay short
+    if (name) {
+        if (strlen(name) > 99 || strlen(t->dir) > 154)
+            return EXIT_FAILURE;
+        snprintf(h, 100, "%s", name);
+        snprintf(h + 345, 155, "%s", t->dir);
+    } else {
+        if (strlen(t->dir) > 98)
+            return EXIT_FAILURE;
+        snprintf(h, 100, "%s/", t->dir);
+    }
+
+    snprintf(h + 100, 8, "%07o", name ? 0644 : 0755);
+    snprintf(h + 108, 8, "%07o", 0);
+    snprintf(h + 116, 8, "%07o", 0);
+    snprintf(h + 124, 12, "%011llo", size);
+    snprintf(h + 136, 12, "%011llo", (unsigned long long)t->mtime);
+    h[156] = name ? '0' : '5';
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+
+    // the checksum is computed with its own field set to spaces
+    memset(h + 148, ' ', 8);
+    unsigned sum = 0;
+    for (size_t i = 0; i < sizeof(h); ++i)
+        sum += (unsigned char)h[i];
+    snprintf(h + 148, 7, "%06o", sum);
+
+    return fwrite(h, 1, sizeof(h), t->f) == sizeof(h) ? EXIT_SUCCESS
+                                                       : EXIT_FAILURE;
+}
+
+/*
+ * Write one regular member from memory, padded to a 512-byte boundary.
+ */
+static int tar_member(TarWriter *t, const char *name, const uint8_t *data,
+                      size_t size) {
+    static const uint8_t zero[512] = {0};
+    size_t padding = (512 - size % 512) % 512;
+
+    if (tar_header(t, name, size) != EXIT_SUCCESS ||
+        fwrite(data, 1, size, t->f) != size ||
+        fwrite(zero, 1, padding, t->f) != padding)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Extract all files of an ACF archive, named as in a full extraction, and its
+ * filelist.json into a single tar stream written to 'tarPath', or to stdout
+ * when it is "-". The members are written in index order under a directory
+ * named after the archive, so unpacking the tar next to the archive gives the
+ * same tree as extract_acf.
+ */
+static int extract_tar(const char *path, const char *tarPath) {
+    char **metaNames = NULL;
+    int *metaStates = NULL;
+    uint8_t *decoded = NULL;
+    size_t decodedCap = 0;
+    FILE *json = NULL;
+    FILE *out = NULL;
+    int toStdout = !strcmp(tarPath, "-");
+    int status = EXIT_FAILURE;
+
+    MappedFile archive;
+    if (map_file(path, &archive) != EXIT_SUCCESS) {
+        fprintf(stderr, "extract_acf: cannot read %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    ACFHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    size_t fatOffset = 0;
+    if (archive.size >= sizeof(hdr)) {
+        memcpy(&hdr, archive.data, sizeof(hdr));
+        fatOffset = hdr.headerSize;
+    }
+
+    if (archive.size < sizeof(hdr) || memcmp(hdr.magic, "acf", 3) != 0 ||
+        fatOffset > archive.size ||
+        hdr.numFiles > (archive.size - fatOffset) / sizeof(FATEntry)) {
+        fprintf(stderr, "extract_acf: %s is not a valid ACF archive\n", path);
+        goto done;
+    }
+
+    const FATEntry *entries = (const FATEntry *)(archive.data + fatOffset);
+
+    // allocate at least 1 element to avoid passing zero to calloc
+    metaNames = calloc(hdr.numFiles ? hdr.numFiles : 1, sizeof(*metaNames));
+    metaStates = calloc(hdr.numFiles ? hdr.numFiles : 1, sizeof(*metaStates));
+    if (!metaNames || !metaStates) {
+        fprintf(stderr, "extract_acf: memory allocation failed\n");
+        goto done;
+    }
+
+    if (toStdout) {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        out = stdout;
+    } else {
+        out = xfopen(tarPath, "wb");
+        if (!out) {
+            fprintf(stderr, "extract_acf: cannot create %s\n", tarPath);
+            goto done;
+        }
+    }
+
+    char outdir[512];
+    make_outdir(outdir, sizeof(outdir), path);
+
+    // an archive read from stdin has no date of its own
+    struct stat st;
+    TarWriter tar = {.f = out,
+                     .dir = path_basename(outdir),
+                     .mtime = stat(path, &st) == 0 ? (long long)st.st_mtime
+                                                   : (long long)time(NULL)};
+
+    if (tar_header(&tar, NULL, 0) != EXIT_SUCCESS)
+        goto write_error;
+
+    for (uint32_t i = 0; i < hdr.numFiles; ++i) {
+        const FATEntry e = entries[i];
+        size_t dataOffset = (size_t)hdr.dataStart + (size_t)e.relativeOffset;
+        size_t size = e.inputSize ? e.inputSize : e.outputSize;
+
+        // sentinel value marks an absent entry
+        int absent = e.relativeOffset == 0xFFFFFFFFu;
+        if (!absent &&
+            (dataOffset >= archive.size || size > archive.size - dataOffset)) {
+            fprintf(stderr, "extract_acf: entry %u: data exceeds file size\n",
+                    i);
+            absent = 1;
+        }
+
+        if (absent) {
+            if (set_meta_bin_name(metaNames, hdr.numFiles, i) != EXIT_SUCCESS)
+                goto alloc_error;
+            metaStates[i] = -1;
+            continue;
+        }
+
+        const uint8_t *data = archive.data + dataOffset;
+        size_t dataSize = size;
+        int compressed = 0;
+
+        // decode in memory first: a tar header needs the exact size
+        if (e.inputSize > 0 && data[0] == 0x10) {
+            size_t decSize = lz10_peek_size(data, size);
+            if (decSize > decodedCap) {
+                uint8_t *grown = realloc(decoded, decSize);
+                if (!grown)
+                    goto alloc_error;
+                decoded = grown;
+                decodedCap = decSize;
+            }
+
+            size_t outSize = 0;
+            if (decSize &&
+                lz10_decompress_into(data, size, decoded, decodedCap,
+                                     &outSize) == 0) {
+                data = decoded;
+                dataSize = outSize;
+                compressed = 1;
+            } else {
+                fprintf(stderr,
+                        "extract_acf: decompression failed for entry %u, "
+                        "saving raw\n",
+                        i);
+            }
+        }
+
+        char extBuf[16], relname[64];
+        const char *ext = try_get_extension(data, dataSize, 4, 2, "bin",
+                                            extBuf, sizeof(extBuf));
+        make_index_name(relname, sizeof(relname), i, ext);
+
+        if (tar_member(&tar, relname, data, dataSize) != EXIT_SUCCESS)
+            goto write_error;
+
+        if (set_meta_name(metaNames, hdr.numFiles, i, relname) != EXIT_SUCCESS)
+            goto alloc_error;
+        metaStates[i] = compressed ? 1 : 0;
+    }
+
+    // filelist.json goes through a temporary file to learn its size
+    json = tmpfile();
+    long long jsonSize = -1;
+    if (json && write_json_states(json, metaNames, metaStates,
+                                  hdr.numFiles) == EXIT_SUCCESS)
+        jsonSize = file_size(json);
+
+    uint8_t *jsonData = jsonSize >= 0 ? malloc((size_t)jsonSize + 1) : NULL;
+    if (!jsonData ||
+        fread(jsonData, 1, (size_t)jsonSize, json) != (size_t)jsonSize) {
+        free(jsonData);
+        fprintf(stderr, "extract_acf: cannot create metadata file\n");
+        goto done;
+    }
+
+    static const uint8_t endBlocks[1024] = {0};
+    int ok = tar_member(&tar, "filelist.json", jsonData, (size_t)jsonSize) ==
+                 EXIT_SUCCESS &&
+             fwrite(endBlocks, 1, sizeof(endBlocks), out) ==
+                 sizeof(endBlocks) &&
+             fflush(out) == 0;
+    free(jsonData);
+    if (!ok)
+        goto write_error;
+
+    if (!toStdout)
+        printf("  %s: %u entries written to %s\n", path_basename(path),
+               hdr.numFiles, tarPath);
+    status = EXIT_SUCCESS;
+    goto done;
+
+alloc_error:
+    fprintf(stderr, "extract_acf: memory allocation failed\n");
+    goto done;
+write_error:
+    fprintf(stderr, "extract_acf: failed writing %s\n",
+            toStdout ? "standard output" : tarPath);
+done:
+    if (out && out != stdout && fclose(out) != 0 && status == EXIT_SUCCESS) {
+        fprintf(stderr, "extract_acf: failed writing %s\n", tarPath);
+        status = EXIT_FAILURE;
+    }
+    if (json)
+        fclose(json);
+    free(decoded);
+    free_string_array(metaNames, hdr.numFiles);
+    free(metaStates);
+    unmap_file(&archive);
+    return status;
+}
+
+/*
+ * qsort comparator for an array of strings.
+ */
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Append directory/name to a growing array of paths.
+ */
+static int add_archive(char ***paths, uint32_t *count, uint32_t *cap,
+                       const char *directory, const char *name) {
+    if (*count == *cap) {
+        uint32_t newCap = *cap ? *cap * 2 : 16;
+        char **grown = realloc(*paths, newCap * sizeof(*grown));
+        if (!grown)
+            return EXIT_FAILURE;
+        *paths = grown;
+        *cap = newCap;
+    }
+
+    size_t len = strlen(directory) + 1 + strlen(name) + 1;
+    char *path = malloc(len);
+    if (!path)
+        return EXIT_FAILURE;
+
+    join_path(path, len, directory, name);
+    (*paths)[(*count)++] = path;
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Archives found so far by collect_archives, and the directories it has yet
+ * to scan.
+ */
+typedef struct {
+    char **paths;
+    uint32_t count;
+    uint32_t cap;
+    char **dirs; // stack of directories to scan
+    uint32_t numDirs;
+    uint32_t dirCap;
+    uint32_t unreadable; // directories that could not be opened
+} ArchiveScan;
+
+/*
+ * Check whether a file ends with ".acf", in any case.
+ */
+static int has_acf_extension(const char *name) {
+    const char *ext = strrchr(name, '.'); // find the extension to filter by
+#ifdef _WIN32
+    return ext && _stricmp(ext, ".acf") == 0;
+#else
+    return ext && strcasecmp(ext, ".acf") == 0;
+#endif
+}
+
+/*
+ * Add the "*.acf" files of one directory to the scan and, when recursive, push
+ * its subdirectories. A directory that cannot be opened is reported and
+ * counted; only running out of memory returns EXIT_FAILURE.
+ */
+#ifdef _WIN32
+static int scan_directory(const char *directory, int recursive,
+                          ArchiveScan *scan) {
+    char searchPath[512];
+    snprintf(searchPath, sizeof(searchPath), "%s\\*", directory);
+
+    struct _finddata_t file;
+    intptr_t hFile = _findfirst(searchPath, &file);
+    if (hFile == -1L) {
+        fprintf(stderr, "collect_archives: cannot open directory %s\n",
+                directory);
+        ++scan->unreadable;
+        return EXIT_SUCCESS;
+    }
+
+    int status = EXIT_SUCCESS;
+    do {
+        const char *name = file.name;
+
+        if (file.attrib & _A_SUBDIR) {
+            if (recursive && strcmp(name, ".") && strcmp(name, ".."))
+                status = add_archive(&scan->dirs, &scan->numDirs,
+                                     &scan->dirCap, directory, name);
+        } else if (has_acf_extension(name)) {
+            status = add_archive(&scan->paths, &scan->count, &scan->cap,
+                                 directory, name);
+        }
+    } while (status == EXIT_SUCCESS && _findnext(hFile, &file) == 0);
+
+    _findclose(hFile);
+    return status;
+}
+#else
+/*
+ * Check whether a directory entry is itself a directory. Symbolic links are
+ * not followed, so a link back up the tree cannot make the walk loop.
+ */
+static int is_subdirectory(const char *directory, const struct dirent *entry) {
+#ifdef _DIRENT_HAVE_D_TYPE
+    if (entry->d_type != DT_UNKNOWN)
+        return entry->d_type == DT_DIR;
+#endif
+
+    char path[768];
+    join_path(path, sizeof(path), directory, entry->d_name);
+
+    struct stat st;
+    return lstat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static int scan_directory(const char *directory, int recursive,
+                          ArchiveScan *scan) {
+    DIR *dir = opendir(directory);
+    if (!dir) {
+        fprintf(stderr, "collect_archives: cannot open directory %s\n",
+                directory);
+        ++scan->unreadable;
+        return EXIT_SUCCESS;
+    }
+
+    int status = EXIT_SUCCESS;
+    struct dirent *entry;
+    while (status == EXIT_SUCCESS && (entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+
+        if (recursive && strcmp(name, ".") && strcmp(name, "..") &&
+            is_subdirectory(directory, entry))
+            status = add_archive(&scan->dirs, &scan->numDirs, &scan->dirCap,
+                                 directory, name);
+        else if (has_acf_extension(name))
+            status = add_archive(&scan->paths, &scan->count, &scan->cap,
+                                 directory, name);
+    }
+
+    closedir(dir);
+    return status;
+}
+#endif
+
+/*
+ * Check whether a directory holds a filelist.json, which marks an extraction
+ * output or a build input rather than a tree of archives.
+ */
+static int has_filelist(const char *directory) {
+    char path[768];
+    join_path(path, sizeof(path), directory, "filelist.json");
+
+    struct stat st;
+    return stat(path, &st) == 0;
+}
+
+/*
+ * List the "*.acf" files of a directory, sorted by path, into a string array
+ * to release with free_string_array. When recursive, the whole tree below it
+ * is walked with an explicit stack, skipping the directories that hold a
+ * filelist.json.
+ */
+static int collect_archives(const char *directory, int recursive,
+                            char ***outPaths, uint32_t *outCount) {
+    ArchiveScan scan = {0};
+    int status = scan_directory(directory, recursive, &scan);
+    if (status == EXIT_SUCCESS && scan.unreadable)
+        return EXIT_FAILURE; // the directory itself, so nothing was found
+
+    // subdirectories that cannot be opened are skipped
+    while (status == EXIT_SUCCESS && scan.numDirs > 0) {
+        char *sub = scan.dirs[--scan.numDirs];
+        if (!has_filelist(sub))
+            status = scan_directory(sub, recursive, &scan);
+        free(sub);
+    }
+
+    free_string_array(scan.dirs, scan.numDirs);
+
+    if (status != EXIT_SUCCESS) {
+        fprintf(stderr, "collect_archives: memory allocation failed\n");
+        free_string_array(scan.paths, scan.count);
+        return EXIT_FAILURE;
+    }
+
+    if (scan.count > 1)
+        qsort(scan.paths, scan.count, sizeof(*scan.paths), compare_strings);
+
+    *outPaths = scan.paths;
+    *outCount = scan.count;
+    return EXIT_SUCCESS;
+}
+
+/*
+ * One archive of a directory extraction.
+ */
+typedef struct {
+    const char *path;
+    long long size;
+    int status; // extract_acf result
+} DirArchive;
+
+/*
+ * Sort archives largest-first, so the longest extractions start early and
+ * small ones fill the gaps at the end; ties are broken by path.
+ */
+static int compare_archive_sizes(const void *a, const void *b) {
+    const DirArchive *x = a, *y = b;
+    if (x->size != y->size)
+        return x->size > y->size ? -1 : 1;
+    return strcmp(x->path, y->path);
+}
+
+static int compare_archive_paths(const void *a, const void *b) {
+    return strcmp(((const DirArchive *)a)->path, ((const DirArchive *)b)->path);
+}
+
+/*
+ * State shared by the workers of a directory extraction.
+ */
+typedef struct {
+    DirArchive *archives;
+    uint32_t count;
+    unsigned innerJobs; // threads used inside each archive
+    int incremental;    // passed on to extract_acf
+    int ioUring;        // passed on to extract_acf
+    Mutex lock;         // guards done and the progress line
+    uint32_t done;
+} DirJob;
+
+/*
+ * parallel_for callback: extract one archive and update the progress line.
+ */
+static void dir_worker(void *arg, size_t index, unsigned worker) {
+    (void)worker;
+    DirJob *job = arg;
+    DirArchive *a = &job->archives[index];
+
+    a->status = extract_acf(a->path, job->innerJobs, 0, job->incremental,
+                            job->ioUring);
+
+    mutex_lock(&job->lock);
+    uint32_t done = ++job->done;
+    printf("\r  extracted %u/%u archives", done, job->count);
+    fflush(stdout);
+    mutex_unlock(&job->lock);
+}
+
+/*
+ * Extract every "*.acf" file in a directory, or in the tree below it when
+ * recursive, on up to 'jobs' threads, then list the archives that failed.
+ */
+static int process_directory(const char *directory, int recursive,
+                             unsigned jobs, int incremental, int ioUring) {
+    char **paths = NULL;
+    uint32_t count = 0;
+    if (collect_archives(directory, recursive, &paths, &count) !=
+        EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    if (count == 0) {
+        printf("No acf archives found in %s\n", directory);
+        free_string_array(paths, count);
+        return EXIT_SUCCESS;
+    }
+
+    DirArchive *archives = calloc(count, sizeof(*archives));
+    if (!archives) {
+        fprintf(stderr, "process_directory: memory allocation failed\n");
+        free_string_array(paths, count);
+        return EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        struct stat st;
+        archives[i].path = paths[i];
+        archives[i].size = stat(paths[i], &st) == 0 ? (long long)st.st_size : 0;
+    }
+
+    qsort(archives, count, sizeof(*archives), compare_archive_sizes);
+
+    /*
+     * Spread the threads over the archives first; only when there are fewer
+     * archives than threads are the leftovers used inside each archive.
+     */
+    DirJob job = {.archives = archives,
+                  .count = count,
+                  .innerJobs = 1,
+                  .incremental = incremental,
+                  .ioUring = ioUring};
+    unsigned outerJobs = jobs;
+    if (outerJobs > count) {
+        outerJobs = count;
+        job.innerJobs = jobs / count;
+    }
+
+    if (mutex_init(&job.lock) != 0) {
+        fprintf(stderr, "process_directory: cannot create mutex\n");
+        free(archives);
+        free_string_array(paths, count);
+        return EXIT_FAILURE;
+    }
+
+    parallel_for(outerJobs, count, dir_worker, &job);
+    mutex_destroy(&job.lock);
+
+    printf("\n");
+
+    // report failures in name order
+    qsort(archives, count, sizeof(*archives), compare_archive_paths);
+
+    uint32_t failed = 0;
+    for (uint32_t i = 0; i < count; ++i)
+        failed += archives[i].status != EXIT_SUCCESS;
+
+    if (failed) {
+        fprintf(stderr, "%u of %u archives failed:\n", failed, count);
+        for (uint32_t i = 0; i < count; ++i) {
+            if (archives[i].status != EXIT_SUCCESS)
+                fprintf(stderr, "  %s\n", archives[i].path);
+        }
+    }
+
+    free(archives);
+    free_string_array(paths, count);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Outcome of checking one archive.
+ */
+typedef struct {
+    const char *path;    // archive path
+    int ok;              // set when every check passed
+    uint32_t entries;    // entries present in the FAT
+    uint32_t compressed; // of which LZ10-compressed
+    long entry;          // failing entry, -1 for the archive itself
+    char error[96];      // failure reason
+} CheckResult;
+
+/*
+ * Byte range an entry occupies in the archive.
+ */
+typedef struct {
+    size_t start;
+    size_t end;
+    uint32_t index;
+} EntrySpan;
+
+/*
+ * qsort comparator ordering spans by start offset, then by entry index.
+ */
+static int compare_spans(const void *a, const void *b) {
+    const EntrySpan *x = a, *y = b;
+    if (x->start != y->start)
+        return x->start < y->start ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/*
+ * Record why an archive failed its check.
+ */
+static void check_fail(CheckResult *r, long entry, const char *error) {
+    r->ok = 0;
+    r->entry = entry;
+    snprintf(r->error, sizeof(r->error), "%s", error);
+}
+
+/*
+ * Validate an archive without writing anything: header and FAT bounds, entry
+ * bounds and overlaps, size fields, and every LZ10 stream through a
+ * count-only decode. Stop at the first problem found.
+ */
+static void check_acf(const char *path, CheckResult *r) {
+    r->path = path;
+    r->entries = 0;
+    r->compressed = 0;
+    r->entry = -1;
+    r->error[0] = '\0';
+
+    MappedFile archive;
+    if (map_file(path, &archive) != EXIT_SUCCESS) {
+        check_fail(r, -1, "cannot read file");
+        return;
+    }
+
+    const uint8_t *fileData = archive.data;
+    size_t fileSize = archive.size;
+
+    EntrySpan *spans = NULL;
+    char msg[96];
+
+    ACFHeader hdr;
+    if (fileSize < sizeof(hdr)) {
+        check_fail(r, -1, "file too small to be an ACF");
+        goto done;
+    }
+    memcpy(&hdr, fileData, sizeof(hdr));
+
+    if (memcmp(hdr.magic, "acf", 3) != 0) {
+        check_fail(r, -1, "missing 'acf' magic");
+        goto done;
+    }
+
+    size_t fatOffset = hdr.headerSize;
+    if (fatOffset < sizeof(hdr)) {
+        check_fail(r, -1, "header size too small");
+        goto done;
+    }
+
+    if (fatOffset > fileSize ||
+        hdr.numFiles > (fileSize - fatOffset) / sizeof(FATEntry)) {
+        check_fail(r, -1, "FAT exceeds file size");
+        goto done;
+    }
+
+    if (hdr.dataStart < fatOffset + hdr.numFiles * sizeof(FATEntry)) {
+        check_fail(r, -1, "data region overlaps the FAT");
+        goto done;
+    }
+
+    spans = malloc((hdr.numFiles ? hdr.numFiles : 1) * sizeof(*spans));
+    if (!spans) {
+        check_fail(r, -1, "memory allocation failed");
+        goto done;
+    }
+
+    const FATEntry *entries = (const FATEntry *)(fileData + fatOffset);
+    uint32_t numSpans = 0;
+
+    for (uint32_t i = 0; i < hdr.numFiles; ++i) {
+        const FATEntry e = entries[i];
+
+        // sentinel value marks an absent entry
+        if (e.relativeOffset == 0xFFFFFFFFu)
+            continue;
+
+        size_t dataOffset = (size_t)hdr.dataStart + (size_t)e.relativeOffset;
+        size_t stored = e.inputSize ? e.inputSize : e.outputSize;
+
+        // an empty entry may sit at the very end of the file
+        if (dataOffset > fileSize || (stored && dataOffset == fileSize)) {
+            check_fail(r, i, "offset out of range");
+            goto done;
+        }
+
+        if (stored > fileSize - dataOffset) {
+            check_fail(r, i,
+                       e.inputSize ? "compressed data exceeds file size"
+                                   : "raw data exceeds file size");
+            goto done;
+        }
+
+        if (e.inputSize) {
+            const uint8_t *src = fileData + dataOffset;
+            if (src[0] != 0x10) {
+                snprintf(msg, sizeof(msg),
+                         "unsupported compression method 0x%02X", src[0]);
+                check_fail(r, i, msg);
+                goto done;
+            }
+
+            size_t decSize = 0;
+            if (lz10_validate(src, stored, &decSize) != 0) {
+                check_fail(r, i, "invalid LZ10 stream");
+                goto done;
+            }
+
+            // the FAT holds the decompressed size padded to 4 bytes
+            if (decSize > e.outputSize || e.outputSize - decSize > 3) {
+                snprintf(msg, sizeof(msg),
+                         "decompressed size %zu does not match FAT size %u",
+                         decSize, e.outputSize);
+                check_fail(r, i, msg);
+                goto done;
+            }
+
+            ++r->compressed;
+        }
+
+        ++r->entries;
+
+        // empty entries hold no bytes, whatever their offset
+        if (!stored)
+            continue;
+
+        spans[numSpans].start = dataOffset;
+        spans[numSpans].end = dataOffset + stored;
+        spans[numSpans].index = i;
+        ++numSpans;
+    }
+
+    // no two entries may share bytes
+    qsort(spans, numSpans, sizeof(*spans), compare_spans);
+    for (uint32_t k = 1; k < numSpans; ++k) {
+        if (spans[k].start < spans[k - 1].end) {
+            snprintf(msg, sizeof(msg), "overlaps entry %u", spans[k - 1].index);
+            check_fail(r, spans[k].index, msg);
+            goto done;
+        }
+    }
+
+    r->ok = 1;
+
+done:
+    free(spans);
+    unmap_file(&archive);
+}
+
+/*
+ * parallel_for body checking one archive of the report.
+ */
+static void check_worker(void *arg, size_t index, unsigned worker) {
+    CheckResult *results = arg;
+    (void)worker;
+    check_acf(results[index].path, &results[index]);
+}
+
+/*
+ * Check one archive, or every "*.acf" file of a directory (of the tree below
+ * it when recursive) on up to 'jobs' threads, and print a JSON report to
+ * stdout. Succeed only if every archive passed.
+ */
+static int check_archives(const char *path, int isDir, int recursive,
+                          unsigned jobs) {
+    char **paths = NULL;
+    uint32_t numPaths = 0;
+
+    if (isDir) {
+        if (collect_archives(path, recursive, &paths, &numPaths) !=
+            EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        if (numPaths == 0) {
+            fprintf(stderr, "No acf archives found in %s\n", path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint32_t count = isDir ? numPaths : 1;
+    CheckResult *results = calloc(count, sizeof(*results));
+    if (!results) {
+        fprintf(stderr, "check_archives: memory allocation failed\n");
+        free_string_array(paths, numPaths);
+        return EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < count; ++i)
+        results[i].path = isDir ? paths[i] : path;
+
+    parallel_for(jobs, count, check_worker, results);
+
+    uint32_t failed = 0;
+    printf("{\n  \"archives\": [");
+    for (uint32_t i = 0; i < count; ++i) {
+        const CheckResult *r = &results[i];
+        char *escPath = escape_json_string(r->path, strlen(r->path));
+
+        printf("%s\n    {\"path\": \"%s\", ", i ? "," : "",
+               escPath ? escPath : "");
+        if (r->ok) {
+            printf("\"result\": \"pass\", \"entries\": %u, \"compressed\": %u}",
+                   r->entries, r->compressed);
+        } else {
+            char *escError = escape_json_string(r->error, strlen(r->error));
+            if (r->entry >= 0)
+                printf("\"result\": \"fail\", \"entry\": %ld, ", r->entry);
+            else
+                printf("\"result\": \"fail\", \"entry\": null, ");
+            printf("\"error\": \"%s\"}", escError ? escError : "");
+            free(escError);
+            ++failed;
+        }
+
+        free(escPath);
+    }
+    printf("\n  ],\n  \"passed\": %u,\n  \"failed\": %u\n}\n", count - failed,
+           failed);
+
+    free(results);
+    free_string_array(paths, numPaths);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * One FAT entry as shown by --list.
+ */
+typedef struct {
+    long long offset;  // absolute offset of the stored data
+    uint32_t stored;   // bytes stored in the archive, padding included
+    size_t decoded;    // decoded size, from the LZ10 header when compressed
+    const char *state; // "absent", "raw", "lz10", "damaged" or "invalid"
+    char ext[16];      // sniffed extension
+} ListEntry;
+
+/*
+ * Listing of one archive.
+ */
+typedef struct {
+    const char *path;           // archive path
+    ListEntry *entries;         // one per FAT entry, NULL on failure
+    uint32_t numFiles;          // entries in the FAT
+    uint32_t compressed;        // entries stored as LZ10
+    unsigned long long stored;  // total of the present entries
+    unsigned long long decoded; // total of the present entries
+    char error[96];             // failure reason
+} ListResult;
+
+/*
+ * Fill in the listing of an archive from its header, its FAT and the first
+ * bytes of every entry, without reading the rest of the entry data.
+ */
+static void list_acf(ListResult *r) {
+    FATEntry *fat = NULL;
+
+    FILE *in = xfopen(r->path, "rb");
+    if (!in) {
+        snprintf(r->error, sizeof(r->error), "cannot read file");
+        return;
+    }
+
+    long long fileSize = 0;
+    ACFHeader hdr;
+    const char *error = read_fat(in, &hdr, &fat, &fileSize);
+    if (error) {
+        snprintf(r->error, sizeof(r->error), "%s", error);
+        goto done;
+    }
+
+    r->entries = calloc(hdr.numFiles ? hdr.numFiles : 1, sizeof(*r->entries));
+    if (!r->entries) {
+        snprintf(r->error, sizeof(r->error), "memory allocation failed");
+        goto done;
+    }
+    r->numFiles = hdr.numFiles;
+
+    for (uint32_t i = 0; i < hdr.numFiles; ++i) {
+        const FATEntry e = fat[i];
+        ListEntry *le = &r->entries[i];
+
+        if (e.relativeOffset == 0xFFFFFFFFu) {
+            le->state = "absent";
+            continue;
+        }
+
+        le->offset = (long long)hdr.dataStart + e.relativeOffset;
+        le->stored = e.inputSize ? e.inputSize : e.outputSize;
+        le->decoded = e.outputSize;
+
+        // an empty entry may sit at the very end of the file
+        EntrySniff sniff;
+        if (le->offset > fileSize ||
+            (le->stored && le->offset == fileSize) ||
+            (long long)le->stored > fileSize - le->offset ||
+            sniff_entry(in, le->offset, le->stored, e.inputSize > 0,
+                        &sniff) != EXIT_SUCCESS) {
+            le->state = "invalid";
+            continue;
+        }
+
+        // compressed entries whose first bytes do not decode
+        le->state = e.inputSize ? (sniff.compressed ? "lz10" : "damaged")
+                                : "raw";
+        if (sniff.compressed) {
+            le->decoded = sniff.decSize;
+            r->compressed++;
+        }
+        snprintf(le->ext, sizeof(le->ext), "%s", sniff.ext);
+
+        r->stored += le->stored;
+        r->decoded += le->decoded;
+    }
+
+done:
+    if (error || r->error[0]) {
+        free(r->entries);
+        r->entries = NULL;
+    }
+    fclose(in);
+    free(fat);
+}
+
+/*
+ * parallel_for body listing one archive.
+ */
+static void list_worker(void *arg, size_t index, unsigned worker) {
+    ListResult *results = arg;
+    (void)worker;
+    list_acf(&results[index]);
+}
+
+/*
+ * Print the listing of one archive as a table.
+ */
+static void print_list_table(const ListResult *r) {
+    printf("%s: %u entries, %u compressed, %llu bytes stored, %llu decoded",
+           r->path, r->numFiles, r->compressed, r->stored, r->decoded);
+    if (r->decoded)
+        printf(" (%.1f%%)", 100.0 * (double)r->stored / (double)r->decoded);
+    printf("\n%7s  %10s  %10s  %10s  %-7s  %s\n", "index", "offset", "stored",
+           "decoded", "state", "ext");
+
+    for (uint32_t i = 0; i < r->numFiles; ++i) {
+        const ListEntry *le = &r->entries[i];
+        if (le->state[0] == 'a') { // absent
+            printf("%7u  %10s  %10s  %10s  %s\n", i, "-", "-", "-",
+                   le->state);
+            continue;
+        }
+
+        printf("%7u  0x%08llx  %10u  %10zu  %-7s  %s\n", i,
+               (unsigned long long)le->offset, le->stored, le->decoded,
+               le->state, le->ext);
+    }
+}
+
+/*
+ * Print the listing of one archive as a JSON object.
+ */
+static void print_list_json(const ListResult *r) {
+    char *escPath = escape_json_string(r->path, strlen(r->path));
+    printf("    {\"path\": \"%s\", ", escPath ? escPath : "");
+    free(escPath);
+
+    if (!r->entries) {
+        char *escError = escape_json_string(r->error, strlen(r->error));
+        printf("\"error\": \"%s\"}", escError ? escError : "");
+        free(escError);
+        return;
+    }
+
+    printf("\"stored\": %llu, \"decoded\": %llu, \"ratio\": %.4f, "
+           "\"entries\": [",
+           r->stored, r->decoded,
+           r->decoded ? (double)r->stored / (double)r->decoded : 0.0);
+
+    for (uint32_t i = 0; i < r->numFiles; ++i) {
+        const ListEntry *le = &r->entries[i];
+        printf("%s\n      {\"index\": %u, ", i ? "," : "", i);
+        if (le->state[0] == 'a') { // absent
+            printf("\"state\": \"absent\"}");
+            continue;
+        }
+
+        char *escExt = escape_json_string(le->ext, strlen(le->ext));
+        printf("\"offset\": %lld, \"stored\": %u, \"decoded\": %zu, "
+               "\"state\": \"%s\", \"ext\": \"%s\"}",
+               le->offset, le->stored, le->decoded, le->state,
+               escExt ? escExt : "");
+        free(escExt);
+    }
+    printf("\n    ]}");
+}
+
+/*
+ * List one archive, or every "*.acf" file of a directory (of the tree below it
+ * when recursive) on up to 'jobs' threads, as tables or as a JSON report.
+ * Succeed only if every archive could be listed.
+ */
+static int list_archives(const char *path, int isDir, int recursive,
+                         unsigned jobs, int json) {
+    char **paths = NULL;
+    uint32_t numPaths = 0;
+
+    if (isDir) {
+        if (collect_archives(path, recursive, &paths, &numPaths) !=
+            EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        if (numPaths == 0) {
+            fprintf(stderr, "No acf archives found in %s\n", path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint32_t count = isDir ? numPaths : 1;
+    ListResult *results = calloc(count, sizeof(*results));
+    if (!results) {
+        fprintf(stderr, "list_archives: memory allocation failed\n");
+        free_string_array(paths, numPaths);
+        return EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < count; ++i)
+        results[i].path = isDir ? paths[i] : path;
+
+    parallel_for(jobs, count, list_worker, results);
+
+    uint32_t failed = 0;
+    if (json)
+        printf("{\n  \"archives\": [\n");
+    for (uint32_t i = 0; i < count; ++i) {
+        const ListResult *r = &results[i];
+        failed += !r->entries;
+
+        if (json) {
+            print_list_json(r);
+            printf("%s\n", i + 1 < count ? "," : "");
+        } else if (r->entries) {
+            if (i)
+                printf("\n");
+            print_list_table(r);
+        } else {
+            fprintf(stderr, "list_acf: %s: %s\n", r->path, r->error);
+        }
+
+        free(r->entries);
+    }
+    if (json)
+        printf("  ],\n  \"failed\": %u\n}\n", failed);
+
+    free(results);
+    free_string_array(paths, numPaths);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Pass encoder output straight to the archive file.
+ */
+static int write_sink(void *user, const uint8_t *data, size_t size) {
+    return fwrite(data, 1, size, (FILE *)user) == size ? 0 : -1;
+}
+
+/*
+ * Copy one file into the archive at the current position of out, reading it
+ * block by block and compressing it on the fly when *state asks for it
+ * (1 = compressed, 2 = "auto"). *state is set to 0 when the entry ends up
+ * stored raw, and *estimated when the size estimate alone decided so. Fill in
+ * the sizes of the FAT entry, padding included.
+ */
+static int pack_entry(FILE *out, long entryStart, const char *path,
+                      int *state, unsigned margin, LZ10Encoder *enc,
+                      FATEntry *entry, int *estimated) {
+    static const unsigned char zero_pad[4] = {0};
+
+    FILE *in = xfopen(path, "rb");
+    if (!in) {
+        fprintf(stderr, "build_acf: missing file referenced by JSON: %s\n",
+                path);
+        return EXIT_FAILURE;
+    }
+
+    uint8_t *block = malloc(PACK_BLOCK_SIZE);
+    long long fsz = file_size(in);
+    if (!block || fsz < 0 || fsz > 0xFFFFFFFFLL - 3) {
+        fprintf(stderr, "build_acf: cannot read %s\n", path);
+        goto error;
+    }
+
+    size_t sz = (size_t)fsz;
+    size_t n = 0;
+
+    /*
+     * For "auto" entries, a fast encode of a sample tells whether the data
+     * is worth a full encode; only bother on entries much larger than it.
+     */
+    if (*state == 2 && sz > 2 * LZ10_SAMPLE_SIZE) {
+        if (fread(block, 1, LZ10_SAMPLE_SIZE, in) != LZ10_SAMPLE_SIZE) {
+            fprintf(stderr, "build_acf: cannot read %s\n", path);
+            goto error;
+        }
+
+        if (lz10_estimate_size(block, sz) >= sz) {
+            *state = 0;
+            *estimated = 1;
+        }
+        rewind(in);
+    }
+
+    size_t outSize = sz; // bytes written to out, padding excluded
+
+    if (*state) {
+        if (lz10_encoder_begin(enc, sz, write_sink, out) != 0)
+            goto compress_error;
+
+        while ((n = fread(block, 1, PACK_BLOCK_SIZE, in)) > 0) {
+            if (lz10_encoder_feed(enc, block, n) != 0)
+                goto compress_error;
+        }
+
+        if (lz10_encoder_finish(enc, &outSize) != 0)
+            goto compress_error;
+
+        // "auto" entries must save at least the margin once padded; otherwise
+        // write the file again as raw data over the compressed one
+        size_t paddedRaw = sz + pad4((uint32_t)sz);
+        size_t paddedComp = outSize + pad4((uint32_t)outSize);
+        if (*state == 2 &&
+            (paddedComp >= paddedRaw ||
+             (paddedRaw - paddedComp) * 100 < paddedRaw * margin)) {
+            if (fseek(out, entryStart, SEEK_SET) != 0) {
+                fprintf(stderr, "build_acf: seek failed for %s\n", path);
+                goto error;
+            }
+            rewind(in);
+            *state = 0;
+            outSize = sz;
+        }
+    }
+
+    if (!*state) {
+        size_t total = 0;
+        while ((n = fread(block, 1, PACK_BLOCK_SIZE, in)) > 0) {
+            if (fwrite(block, 1, n, out) != n) {
+                fprintf(stderr, "build_acf: write failed for %s\n", path);
+                goto error;
+            }
+            total += n;
+        }
+
+        if (total != sz) {
+            fprintf(stderr, "build_acf: failed to read entire file %s\n",
+                    path);
+            goto error;
+        }
+    }
+
+    uint32_t padding = pad4((uint32_t)outSize); // pad to 4-byte boundary
+    if (padding && fwrite(zero_pad, 1, padding, out) != padding) {
+        fprintf(stderr, "build_acf: write failed for %s\n", path);
+        goto error;
+    }
+
+    // inputSize is the padded compressed size, 0 for raw data
+    entry->inputSize = *state ? (uint32_t)(outSize + padding) : 0;
+    entry->outputSize = (uint32_t)(sz + pad4((uint32_t)sz));
+
+    free(block);
+    fclose(in);
+    return EXIT_SUCCESS;
+
+compress_error:
+    fprintf(stderr, "build_acf: compression failed for %s\n", path);
+error:
+    free(block);
+    fclose(in);
+    return EXIT_FAILURE;
+}
+
+/*
+ * Progress of one entry through the build pipeline.
+ */
+typedef enum {
+    SLOT_PENDING, // not read yet
+    SLOT_READING, // being read
+    SLOT_READ,    // read, waiting for a worker
+    SLOT_PACKING, // being compressed
+    SLOT_DONE,    // ready for the writer
+} SlotStage;
+
+/*
+ * One entry of the build pipeline.
+ */
+typedef struct {
+    SlotStage stage;
+    int state;       // filelist.json state, 0 once the entry is stored raw
+    int estimated;   // stored raw because of the size estimate
+    int streamed;    // too large to hold in memory; packed by the writer
+    int failed;      // reading or compressing failed, already reported
+    uint8_t *data;   // file contents
+    size_t size;     // file size
+    uint8_t *packed; // compressed payload
+    size_t packedSize;
+    size_t packedCap;
+} PackSlot;
+
+/*
+ * State shared by the reader, the compression workers and the writer of a
+ * build. Each of them waits on a condition of its own, so that a change of
+ * stage only wakes the thread that can act on it.
+ */
+typedef struct {
+    char *const *files;
+    PackSlot *slots;
+    uint32_t numFiles;
+    int level;
+    unsigned margin;
+    uint32_t window;    // slots that may be read ahead of the writer
+    uint32_t nextRead;  // next slot for the reader
+    uint32_t nextWrite; // next slot for the writer
+    int readerDone;     // no slot will become SLOT_READ any more
+    int paused;         // the writer is streaming an entry on every job
+    unsigned packing;   // slots the workers are compressing
+    int stop;           // set when the threads must return
+    int ready;          // lock and the conditions are initialised
+    Mutex lock;
+    Cond space; // the writer moved on: the reader may read further
+    Cond work;  // a slot was read, the reader is done or the pause is over
+    Cond done;  // the slot the writer waits on was read or packed
+    Thread *threads; // the reader, then the workers
+    unsigned numThreads;
+} PackPipeline;
+
+/*
+ * Read entry i into memory, or flag it for the writer to stream when it is
+ * too large.
+ */
+static void read_slot(PackPipeline *p, uint32_t i) {
+    PackSlot *s = &p->slots[i];
+    const char *path = p->files[i];
+
+    FILE *in = xfopen(path, "rb");
+    if (!in) {
+        fprintf(stderr, "build_acf: missing file referenced by JSON: %s\n",
+                path);
+        s->failed = 1;
+        return;
+    }
+
+    long long fsz = file_size(in);
+    if (fsz > PIPE_MAX_ENTRY) {
+        s->streamed = 1; // pack_entry opens it again
+    } else if (fsz < 0 || !(s->data = malloc(fsz ? (size_t)fsz : 1)) ||
+               fread(s->data, 1, (size_t)fsz, in) != (size_t)fsz) {
+        fprintf(stderr, "build_acf: cannot read %s\n", path);
+        s->failed = 1;
+    } else {
+        s->size = (size_t)fsz;
+    }
+
+    fclose(in);
+}
+
+/*
+ * Encoder sink appending to the compressed payload of a slot.
+ */
+static int slot_sink(void *user, const uint8_t *data, size_t size) {
+    PackSlot *s = user;
+
+    if (s->packedSize + size > s->packedCap) {
+        size_t cap = s->packedCap ? s->packedCap : PACK_BLOCK_SIZE;
+        while (cap < s->packedSize + size)
+            cap *= 2;
+
+        uint8_t *grown = realloc(s->packed, cap);
+        if (!grown)
+            return -1;
+        s->packed = grown;
+        s->packedCap = cap;
+    }
+
+    memcpy(s->packed + s->packedSize, data, size);
+    s->packedSize += size;
+    return 0;
 }
 
 /*
- * Extract all files from an ACF archive into a sibling directory with the same
- * name minus the extension.
+ * Compress a slot read into memory, making the same choices as pack_entry: an
+ * "auto" entry is stored raw when the size estimate or the margin says so.
  */
-static int extract_acf(const char *path) {
-    if (!path)
-        return EXIT_FAILURE;
+static void pack_slot(PackPipeline *p, uint32_t i, LZ10Encoder *enc) {
+    PackSlot *s = &p->slots[i];
+    if (s->failed || s->streamed || !s->state)
+        return;
 
-    size_t fileSize = 0;
-    uint8_t *fileData = read_file(path, &fileSize);
-    if (!fileData) {
-        fprintf(stderr, "extract_acf: cannot read %s\n", path);
-        return EXIT_FAILURE;
+    if (s->state == 2 && s->size > 2 * LZ10_SAMPLE_SIZE &&
+        lz10_estimate_size(s->data, s->size) >= s->size) {
+        s->state = 0;
+        s->estimated = 1;
+        return;
     }
 
-    if (fileSize < sizeof(ACFHeader)) {
-        fprintf(stderr, "extract_acf: %s is too small to be an ACF\n", path);
-        free(fileData);
-        return EXIT_FAILURE;
+    size_t outSize = 0;
+    if (lz10_encoder_begin(enc, s->size, slot_sink, s) != 0 ||
+        lz10_encoder_feed(enc, s->data, s->size) != 0 ||
+        lz10_encoder_finish(enc, &outSize) != 0) {
+        fprintf(stderr, "build_acf: compression failed for %s\n",
+                p->files[i]);
+        s->failed = 1;
+        return;
     }
 
-    ACFHeader hdr;
-    memcpy(&hdr, fileData, sizeof(hdr));
-
-    if (memcmp(hdr.magic, "acf", 3) != 0) {
-        fprintf(stderr, "extract_acf: %s does not have an 'acf\\0' header\n",
-                path);
-        free(fileData);
-        return EXIT_FAILURE;
-    }
+    size_t paddedRaw = s->size + pad4((uint32_t)s->size);
+    size_t paddedComp = outSize + pad4((uint32_t)outSize);
+    if (s->state == 2 &&
+        (paddedComp >= paddedRaw ||
+         (paddedRaw - paddedComp) * 100 < paddedRaw * p->margin))
+        s->state = 0;
+}
 
-    size_t fatOffset = hdr.headerSize;
-    if (fatOffset > fileSize ||
-        hdr.numFiles > (fileSize - fatOffset) / sizeof(FATEntry)) {
-        fprintf(stderr, "extract_acf: FAT table in %s exceeds file size\n",
-                path);
-        free(fileData);
-        return EXIT_FAILURE;
-    }
+/*
+ * Reader thread: read the slots in order, staying within the window ahead of
+ * the writer. Slots stored raw need no worker.
+ */
+static void pack_reader(void *arg) {
+    PackPipeline *p = arg;
+
+    mutex_lock(&p->lock);
+    while (!p->stop && p->nextRead < p->numFiles) {
+        uint32_t i = p->nextRead;
+        if (i < p->nextWrite) { // the writer got there first
+            p->nextRead = p->nextWrite;
+            continue;
+        }
+        if (i >= p->nextWrite + p->window) {
+            cond_wait(&p->space, &p->lock);
+            continue;
+        }
 
-    const FATEntry *entries = (const FATEntry *)(fileData + fatOffset);
+        ++p->nextRead;
+        PackSlot *s = &p->slots[i];
+        if (s->stage != SLOT_PENDING) // absent, or taken by the writer
+            continue;
 
-    char outdir[512];
-    make_outdir(outdir, sizeof(outdir), path);
+        s->stage = SLOT_READING;
+        mutex_unlock(&p->lock);
+        read_slot(p, i);
+        mutex_lock(&p->lock);
 
-    // extract_acf will fail naturally if the dir is unusable
-    (void)mkdir_dir(outdir);
+        s->stage = s->failed || s->streamed || !s->state ? SLOT_DONE
+                                                          : SLOT_READ;
+        if (s->stage == SLOT_READ)
+            cond_signal(&p->work);
 
-    // allocate at least 1 element to avoid passing zero to calloc
-    char **metaNames =
-        calloc(hdr.numFiles ? hdr.numFiles : 1, sizeof(*metaNames));
-    int *metaStates =
-        calloc(hdr.numFiles ? hdr.numFiles : 1, sizeof(*metaStates));
-    if (!metaNames || !metaStates) {
-        fprintf(stderr, "extract_acf: memory allocation failed\n");
-        cleanup_extract(fileData, metaNames, metaStates, hdr.numFiles);
-        return EXIT_FAILURE;
+        // the writer packs the slot it waits on itself if no worker took it
+        if (i == p->nextWrite)
+            cond_broadcast(&p->done);
     }
 
-    char extBuf[16];
+    p->readerDone = 1;
+    cond_broadcast(&p->work);
+    mutex_unlock(&p->lock);
+}
 
-    for (uint32_t i = 0; i < hdr.numFiles; ++i) {
-        const FATEntry e = entries[i];
+/*
+ * Compression worker: pack the lowest slot the reader is done with, in any
+ * order, with an encoder of its own. Workers take no slot while the pipeline
+ * is paused.
+ */
+static void pack_worker(void *arg) {
+    PackPipeline *p = arg;
 
-        // sentinel value marks an absent entry
-        if (e.relativeOffset == 0xFFFFFFFFu) {
-            if (set_meta_bin_name(metaNames, hdr.numFiles, i) != EXIT_SUCCESS) {
-                fprintf(stderr, "extract_acf: memory allocation failed\n");
-                cleanup_extract(fileData, metaNames, metaStates, hdr.numFiles);
-                return EXIT_FAILURE;
-            }
-            metaStates[i] = -1;
+    // without an encoder, leave every slot to the writer
+    LZ10Encoder *enc = lz10_encoder_create(p->level, 1);
+
+    mutex_lock(&p->lock);
+    while (enc && !p->stop) {
+        if (p->paused) {
+            cond_wait(&p->work, &p->lock);
             continue;
         }
 
-        size_t dataOffset = (size_t)hdr.dataStart + (size_t)e.relativeOffset;
-        if (dataOffset >= fileSize) {
-            fprintf(stderr, "extract_acf: entry %u: offset out of range\n", i);
-            if (set_meta_bin_name(metaNames, hdr.numFiles, i) != EXIT_SUCCESS) {
-                fprintf(stderr, "extract_acf: memory allocation failed\n");
-                cleanup_extract(fileData, metaNames, metaStates, hdr.numFiles);
-                return EXIT_FAILURE;
-            }
-            metaStates[i] = -1;
-            continue;
+        uint32_t i = p->nextWrite;
+        while (i < p->nextRead && p->slots[i].stage != SLOT_READ)
+            ++i;
+
+        if (i < p->nextRead) {
+            p->slots[i].stage = SLOT_PACKING;
+            ++p->packing;
+            mutex_unlock(&p->lock);
+            pack_slot(p, i, enc);
+            mutex_lock(&p->lock);
+
+            p->slots[i].stage = SLOT_DONE;
+            --p->packing;
+            cond_signal(&p->done);
+        } else if (p->readerDone) {
+            break;
+        } else {
+            cond_wait(&p->work, &p->lock);
         }
+    }
 
-        const uint8_t *src = fileData + dataOffset;
-        uint8_t *outBuf = NULL;
-        size_t outSize = 0;
-        int compressed = 0;
+    // the writer may be waiting for this worker to take a slot
+    cond_broadcast(&p->done);
+    mutex_unlock(&p->lock);
 
-        if (e.inputSize > 0) { // the entry is compressed
-            if (dataOffset + (size_t)e.inputSize > fileSize) {
-                fprintf(stderr,
-                        "extract_acf: entry %u: compressed data exceeds file "
-                        "size\n",
-                        i);
-                if (set_meta_bin_name(metaNames, hdr.numFiles, i) !=
-                    EXIT_SUCCESS) {
-                    fprintf(stderr, "extract_acf: memory allocation failed\n");
-                    cleanup_extract(fileData, metaNames, metaStates,
-                                    hdr.numFiles);
-                    return EXIT_FAILURE;
-                }
-                metaStates[i] = -1;
-                continue;
-            }
+    lz10_encoder_destroy(enc);
+}
 
-            if (src[0] == 0x10) { // LZ10 compression type byte
-                outBuf = lz10_decompress(src, (size_t)e.inputSize, &outSize);
-                if (outBuf) {
-                    compressed = 1;
-                } else {
-                    fprintf(stderr,
-                            "extract_acf: decompression failed for entry %u, "
-                            "saving raw\n",
-                            i);
-                    outSize = (size_t)e.inputSize;
-                    outBuf = malloc(outSize ? outSize : 1);
-                    if (!outBuf) {
-                        fprintf(stderr,
-                                "extract_acf: memory allocation failed\n");
-                        cleanup_extract(fileData, metaNames, metaStates,
-                                        hdr.numFiles);
-                        return EXIT_FAILURE;
-                    }
-                    memcpy(outBuf, src, outSize);
-                }
-            } else {
-                outSize = (size_t)e.inputSize;
-                outBuf = malloc(outSize ? outSize : 1);
-                if (!outBuf) {
-                    fprintf(stderr, "extract_acf: memory allocation failed\n");
-                    cleanup_extract(fileData, metaNames, metaStates,
-                                    hdr.numFiles);
-                    return EXIT_FAILURE;
-                }
-                memcpy(outBuf, src, outSize);
-            }
-        } else { // inputSize == 0: the entry is uncompressed; use outputSize
-            if (dataOffset + (size_t)e.outputSize > fileSize) {
-                fprintf(stderr,
-                        "extract_acf: entry %u: raw data exceeds file size\n",
-                        i);
-                if (set_meta_bin_name(metaNames, hdr.numFiles, i) !=
-                    EXIT_SUCCESS) {
-                    fprintf(stderr, "extract_acf: memory allocation failed\n");
-                    cleanup_extract(fileData, metaNames, metaStates,
-                                    hdr.numFiles);
-                    return EXIT_FAILURE;
-                }
-                metaStates[i] = -1;
-                continue;
-            }
+/*
+ * Set up the pipeline and start the reader and 'jobs' workers. Threads that
+ * cannot be started are simply missing, since the writer does any work no
+ * thread has taken; with a single job, it does everything in order.
+ */
+static int pipeline_start(PackPipeline *p, char *const *files,
+                          const int *compressFlags, uint32_t numFiles,
+                          int level, unsigned margin, unsigned jobs) {
+    p->files = files;
+    p->numFiles = numFiles;
+    p->level = level;
+    p->margin = margin;
+    p->window = PIPE_WINDOW_PER_JOB * jobs;
+    p->readerDone = 1; // until the reader runs
 
-            outSize = (size_t)e.outputSize;
-            outBuf = malloc(outSize ? outSize : 1);
-            if (!outBuf) {
-                fprintf(stderr, "extract_acf: memory allocation failed\n");
-                cleanup_extract(fileData, metaNames, metaStates, hdr.numFiles);
-                return EXIT_FAILURE;
-            }
-            memcpy(outBuf, src, outSize);
+    // allocate at least 1 element to avoid passing zero to calloc
+    p->slots = calloc(numFiles ? numFiles : 1, sizeof(*p->slots));
+    if (!p->slots) {
+        fprintf(stderr, "build_acf: memory allocation failed\n");
+        return EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < numFiles; ++i) {
+        PackSlot *s = &p->slots[i];
+        s->state = compressFlags[i];
+        if (i == 0 && s->state > 0)
+            s->state = 0; // the first entry is always stored raw
+        if (s->state == -1 || !files[i]) {
+            s->state = -1;
+            s->stage = SLOT_DONE; // absent, nothing to pack
         }
+    }
 
-        const char *ext = try_get_extension(outBuf, outSize, 4, 2, "bin",
-                                            extBuf, sizeof(extBuf));
+    if (mutex_init(&p->lock) != 0) {
+        fprintf(stderr, "build_acf: cannot create mutex\n");
+        return EXIT_FAILURE;
+    }
 
-        char relname[64];
-        make_index_name(relname, sizeof(relname), i, ext);
+    int conds = 0;
+    if (cond_init(&p->space) == 0 && ++conds && cond_init(&p->work) == 0 &&
+        ++conds && cond_init(&p->done) == 0) {
+        p->ready = 1;
+    } else {
+        fprintf(stderr, "build_acf: cannot create condition variable\n");
+        if (conds > 1)
+            cond_destroy(&p->work);
+        if (conds > 0)
+            cond_destroy(&p->space);
+        mutex_destroy(&p->lock);
+        return EXIT_FAILURE;
+    }
 
-        char outname[768];
-        join_path(outname, sizeof(outname), outdir, relname);
+    if (jobs < 2)
+        return EXIT_SUCCESS;
 
-        if (write_file(outname, outBuf, outSize) != 0)
-            fprintf(stderr, "extract_acf: failed writing %s\n", outname);
+    p->threads = calloc(jobs + 1, sizeof(*p->threads));
+    if (!p->threads)
+        return EXIT_SUCCESS;
 
-        if (set_meta_name(metaNames, hdr.numFiles, i, relname) !=
-            EXIT_SUCCESS) {
-            fprintf(stderr, "extract_acf: memory allocation failed\n");
-            free(outBuf);
-            cleanup_extract(fileData, metaNames, metaStates, hdr.numFiles);
-            return EXIT_FAILURE;
-        }
+    p->readerDone = 0;
+    if (thread_start(&p->threads[0], pack_reader, p) != 0) {
+        p->readerDone = 1;
+        return EXIT_SUCCESS;
+    }
 
-        metaStates[i] = compressed ? 1 : 0;
-        free(outBuf);
+    for (p->numThreads = 1; p->numThreads <= jobs; ++p->numThreads) {
+        if (thread_start(&p->threads[p->numThreads], pack_worker, p) != 0)
+            break;
+    }
 
-        // print progress every 32 entries and on the last one
-        if ((i & 31u) == 31u || i == hdr.numFiles - 1) {
-            printf("\r  %s: extracted %u/%u", path_basename(path), i + 1,
-                   hdr.numFiles);
-            fflush(stdout);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Wait until slot i is ready for the writer. A slot no thread has started on,
+ * or one read but not taken by a worker, is read and packed right here with
+ * the writer's encoder, so the build completes even with no worker running.
+ */
+static void pipeline_wait(PackPipeline *p, uint32_t i, LZ10Encoder *enc) {
+    PackSlot *s = &p->slots[i];
+
+    mutex_lock(&p->lock);
+    while (s->stage != SLOT_DONE) {
+        if (s->stage == SLOT_PENDING || s->stage == SLOT_READ) {
+            int read = s->stage == SLOT_PENDING;
+            s->stage = read ? SLOT_READING : SLOT_PACKING;
+            mutex_unlock(&p->lock);
+            if (read)
+                read_slot(p, i);
+            pack_slot(p, i, enc);
+            mutex_lock(&p->lock);
+            s->stage = SLOT_DONE;
+        } else {
+            cond_wait(&p->done, &p->lock);
         }
     }
+    mutex_unlock(&p->lock);
+}
 
-    printf("\n");
+/*
+ * Stop the workers from taking slots and wait for those they are packing, so
+ * that the writer can stream a large entry on every job without more threads
+ * than that compressing at once.
+ */
+static void pipeline_pause(PackPipeline *p) {
+    mutex_lock(&p->lock);
+    p->paused = 1;
+    while (p->packing)
+        cond_wait(&p->done, &p->lock);
+    mutex_unlock(&p->lock);
+}
 
-    char metafile[768];
-    join_path(metafile, sizeof(metafile), outdir, "filelist.json");
+/*
+ * Let the workers take slots again after pipeline_pause.
+ */
+static void pipeline_resume(PackPipeline *p) {
+    mutex_lock(&p->lock);
+    p->paused = 0;
+    cond_broadcast(&p->work);
+    mutex_unlock(&p->lock);
+}
 
-    if (write_json_file_states(metafile, metaNames, metaStates, hdr.numFiles) !=
-        0) {
-        fprintf(stderr, "extract_acf: cannot create metadata file %s\n",
-                metafile);
-        cleanup_extract(fileData, metaNames, metaStates, hdr.numFiles);
-        return EXIT_FAILURE;
+/*
+ * Release the buffers of a written slot and let the reader move on.
+ */
+static void pipeline_advance(PackPipeline *p, uint32_t i) {
+    PackSlot *s = &p->slots[i];
+    free(s->data);
+    free(s->packed);
+    s->data = NULL;
+    s->packed = NULL;
+
+    mutex_lock(&p->lock);
+    p->nextWrite = i + 1;
+    cond_signal(&p->space);
+    mutex_unlock(&p->lock);
+}
+
+/*
+ * Stop and join the pipeline threads, then release every slot.
+ */
+static void pipeline_destroy(PackPipeline *p) {
+    if (p->ready) {
+        mutex_lock(&p->lock);
+        p->stop = 1;
+        cond_broadcast(&p->space);
+        cond_broadcast(&p->work);
+        mutex_unlock(&p->lock);
+
+        for (unsigned t = 0; t < p->numThreads; ++t)
+            thread_join(&p->threads[t]);
+
+        cond_destroy(&p->done);
+        cond_destroy(&p->work);
+        cond_destroy(&p->space);
+        mutex_destroy(&p->lock);
     }
 
-    cleanup_extract(fileData, metaNames, metaStates, hdr.numFiles);
-    return EXIT_SUCCESS;
+    if (p->slots) {
+        for (uint32_t i = 0; i < p->numFiles; ++i) {
+            free(p->slots[i].data);
+            free(p->slots[i].packed);
+        }
+    }
+
+    free(p->slots);
+    free(p->threads);
 }
 
 /*
- * Iterate over every "*.acf" file in a directory and extract each one.
+ * Write a slot packed in memory at the current position of out, padding
+ * included, and fill in the sizes of its FAT entry like pack_entry.
  */
-#ifdef _WIN32
-static void process_directory(const char *directory) {
-    char searchPath[512];
-    snprintf(searchPath, sizeof(searchPath), "%s\\*.acf", directory);
+static int write_slot(FILE *out, const PackSlot *s, FATEntry *entry) {
+    static const unsigned char zero_pad[4] = {0};
 
-    struct _finddata_t file;
-    intptr_t hFile = _findfirst(searchPath, &file);
-    if (hFile == -1L) {
-        printf("No acf archives found in %s\n", directory);
-        return;
-    }
+    const uint8_t *payload = s->state ? s->packed : s->data;
+    size_t size = s->state ? s->packedSize : s->size;
+    uint32_t padding = pad4((uint32_t)size); // pad to 4-byte boundary
 
-    do {
-        char fullPath[512];
-        join_path(fullPath, sizeof(fullPath), directory, file.name);
-        (void)extract_acf(fullPath); // ignore per-file errors
-    } while (_findnext(hFile, &file) == 0);
+    if (fwrite(payload, 1, size, out) != size ||
+        (padding && fwrite(zero_pad, 1, padding, out) != padding))
+        return EXIT_FAILURE;
 
-    _findclose(hFile);
+    // inputSize is the padded compressed size, 0 for raw data
+    entry->inputSize = s->state ? (uint32_t)(size + padding) : 0;
+    entry->outputSize = (uint32_t)(s->size + pad4((uint32_t)s->size));
+    return EXIT_SUCCESS;
 }
-#else
-static void process_directory(const char *directory) {
-    DIR *dir = opendir(directory);
-    if (!dir) {
-        printf("Cannot open directory %s\n", directory);
-        return;
-    }
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        const char *name = entry->d_name;
-        const char *ext = strrchr(name, '.'); // find the extension to filter by
+/*
+ * Copy a finished archive from the start of a staging file to stdout.
+ */
+static int copy_to_stdout(FILE *in) {
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
 
-        if (ext && strcasecmp(ext, ".acf") == 0) {
-            char fullPath[512];
-            join_path(fullPath, sizeof(fullPath), directory, name);
-            (void)extract_acf(fullPath); // ignore per-file errors
-        }
+    uint8_t *buf = malloc(PACK_BLOCK_SIZE);
+    if (!buf || fseek(in, 0, SEEK_SET) != 0) {
+        free(buf);
+        return EXIT_FAILURE;
     }
 
-    closedir(dir);
+    size_t n;
+    int ok = 1;
+    while (ok && (n = fread(buf, 1, PACK_BLOCK_SIZE, in)) > 0)
+        ok = fwrite(buf, 1, n, stdout) == n;
+
+    free(buf);
+    return ok && !ferror(in) && fflush(stdout) == 0 ? EXIT_SUCCESS
+                                                    : EXIT_FAILURE;
 }
-#endif
 
 /*
- * Pack the contents of a directory into a new ACF archive named, guided by the
- * filelist.json file found inside the directory.
+ * Pack the contents of a directory into a new ACF archive, guided by the
+ * filelist.json file found inside the directory. The archive is written to
+ * outPath, to stdout for "-", or next to the directory with its name if
+ * outPath is NULL. Compressed entries are encoded at the given LZ10
+ * compression level, large ones on up to 'jobs' threads. Entries marked
+ * "auto" are stored raw unless compression saves at least 'margin' percent of
+ * their size.
  */
-static int build_acf(const char *directory) {
+static int build_acf(const char *directory, const char *outPath, int level,
+                     unsigned jobs, unsigned margin) {
     if (!directory)
         return EXIT_FAILURE;
 
@@ -436,7 +2791,7 @@ static int build_acf(const char *directory) {
     join_path(metafile, sizeof(metafile), directory, "filelist.json");
 
     char **jsonNames = NULL;
-    int *jsonStates = NULL; // -1 = null; 0 = false; 1 = true
+    int *jsonStates = NULL; // -1 = null; 0 = false; 1 = true; 2 = auto
     uint32_t jsonCount = 0;
 
     if (read_json_file_states(metafile, &jsonNames, &jsonStates, &jsonCount) !=
@@ -458,11 +2813,13 @@ static int build_acf(const char *directory) {
     int *compressFlags = calloc(numFiles, sizeof(*compressFlags));
     FATEntry *fat = NULL;
     FILE *out = NULL;
+    LZ10Encoder *enc = NULL; // the writer's, for entries no worker packed
+    PackPipeline pipe = {0};
 
     if (!files || !compressFlags) {
         fprintf(stderr, "build_acf: memory allocation failed\n");
         cleanup_build(NULL, NULL, files, compressFlags, numFiles, jsonNames,
-                      jsonStates, jsonCount);
+                      jsonStates, jsonCount, NULL);
         return EXIT_FAILURE;
     }
 
@@ -516,7 +2873,7 @@ static int build_acf(const char *directory) {
             continue;
         }
 
-        if (state != 0 && state != 1) {
+        if (state != 0 && state != 1 && state != 2) {
             fprintf(stderr, "build_acf: invalid metadata state for %s\n", name);
             goto error;
         }
@@ -533,11 +2890,23 @@ static int build_acf(const char *directory) {
     }
 
     char outname[512];
-    snprintf(outname, sizeof(outname), "%s.acf", directory);
+    if (outPath)
+        snprintf(outname, sizeof(outname), "%s", outPath);
+    else
+        snprintf(outname, sizeof(outname), "%s.acf", directory);
 
-    out = xfopen(outname, "wb");
+    /*
+     * The header and the FAT are patched once every entry is written, so an
+     * archive bound for stdout is staged in an anonymous temporary file and
+     * only copied out when complete. Progress then goes to stderr.
+     */
+    int toStdout = !strcmp(outname, "-");
+    FILE *log = toStdout ? stderr : stdout;
+
+    out = toStdout ? tmpfile() : xfopen(outname, "wb");
     if (!out) {
-        fprintf(stderr, "build_acf: cannot create %s\n", outname);
+        fprintf(stderr, "build_acf: cannot create %s\n",
+                toStdout ? "a temporary file" : outname);
         goto error;
     }
 
@@ -581,103 +2950,96 @@ static int build_acf(const char *directory) {
         goto error;
     }
 
-    static const unsigned char zero_pad[4] = {0};
+    enc = lz10_encoder_create(level, jobs);
+    if (!enc)
+        goto error;
+
+    // data begins immediately after the FAT
+    hdr.dataStart = (uint32_t)(hdr.headerSize + numFiles * sizeof(FATEntry));
+
+    uint32_t autoCompressed = 0; // "auto" entries stored compressed
+    uint32_t autoRaw = 0;        // "auto" entries stored raw
+    uint32_t autoEstimated = 0;  // of which skipped by the size estimate
+
+    /*
+     * Entries are read and compressed ahead, out of order, by the pipeline
+     * threads; this loop writes them in FAT order as they become ready.
+     */
+    if (pipeline_start(&pipe, files, compressFlags, numFiles, level, margin,
+                       jobs) != EXIT_SUCCESS)
+        goto error;
 
     size_t offset = 0; // running byte offset into the data region
     for (uint32_t i = 0; i < numFiles; ++i) {
+        PackSlot *slot = &pipe.slots[i];
+
         // absent entry; leave the sentinel in the FAT
         if (compressFlags[i] == -1 || !files[i]) {
             fat[i].relativeOffset = 0xFFFFFFFFu;
             fat[i].inputSize = 0;
             fat[i].outputSize = 0;
+            pipeline_advance(&pipe, i);
             continue;
         }
 
-        size_t sz = 0;
-        uint8_t *buf = read_file(files[i], &sz);
-        if (!buf) {
-            fprintf(stderr, "build_acf: missing file referenced by JSON: %s\n",
-                    files[i]);
+        pipeline_wait(&pipe, i, enc);
+        if (slot->failed)
             goto error;
-        }
-
-        int doCompress = compressFlags[i];
-        if (i == 0)
-            doCompress =
-                0; // first entry is always stored raw regardless of metadata
 
         fat[i].relativeOffset = (uint32_t)offset;
 
-        if (doCompress) {
-            size_t compSize = 0;
-            uint8_t *comp = lz10_compress(buf, sz, &compSize);
-            if (!comp) {
-                fprintf(stderr, "build_acf: compression failed for %s\n",
-                        files[i]);
-                free(buf);
-                goto error;
-            }
-
-            uint32_t compPad = pad4((uint32_t)compSize);
-            size_t paddedComp = compSize + compPad; // pad to 4-byte boundary
-
-            if (fwrite(comp, 1, compSize, out) != compSize) {
-                fprintf(stderr, "build_acf: write failed for entry %u\n", i);
-                free(comp);
-                free(buf);
-                goto error;
-            }
-
-            if (compPad && fwrite(zero_pad, 1, compPad, out) !=
-                               compPad) { // zero-fill the padding bytes
-                fprintf(stderr, "build_acf: write failed for entry %u\n", i);
-                free(comp);
-                free(buf);
-                goto error;
-            }
-
-            fat[i].inputSize = (uint32_t)paddedComp; // padded compressed size
-            fat[i].outputSize =
-                (uint32_t)(sz + pad4((uint32_t)sz)); // padded decompressed size
-            offset += paddedComp;
-
-            free(comp);
-        } else {
-            uint32_t rawPad = pad4((uint32_t)sz);
-            size_t padded = sz + rawPad; // pad to 4-byte boundary
-
-            if (fwrite(buf, 1, sz, out) != sz) {
-                fprintf(stderr, "build_acf: write failed for entry %u\n", i);
-                free(buf);
+        // entries too large for the pipeline are packed here as a stream,
+        // with the encoder's threads standing in for the workers
+        if (slot->streamed) {
+            pipeline_pause(&pipe);
+            int packed = pack_entry(out, (long)(hdr.dataStart + offset),
+                                    files[i], &slot->state, margin, enc,
+                                    &fat[i], &slot->estimated);
+            pipeline_resume(&pipe);
+            if (packed != EXIT_SUCCESS)
                 goto error;
-            }
+        } else if (write_slot(out, slot, &fat[i]) != EXIT_SUCCESS) {
+            fprintf(stderr, "build_acf: write failed for %s\n", files[i]);
+            goto error;
+        }
 
-            if (rawPad && fwrite(zero_pad, 1, rawPad, out) !=
-                              rawPad) { // zero-fill the padding bytes
-                fprintf(stderr, "build_acf: write failed for entry %u\n", i);
-                free(buf);
-                goto error;
-            }
+        int doCompress = slot->state;
+        int estimated = slot->estimated;
+        pipeline_advance(&pipe, i);
 
-            fat[i].inputSize = 0; // signals uncompressed in the format
-            fat[i].outputSize = (uint32_t)padded;
-            offset += padded;
+        if (i > 0 && compressFlags[i] == 2) {
+            if (doCompress)
+                ++autoCompressed;
+            else
+                ++autoRaw;
+            autoEstimated += (uint32_t)estimated;
         }
 
-        free(buf);
+        offset += fat[i].inputSize ? fat[i].inputSize : fat[i].outputSize;
 
         // print progress every 32 entries and on the last one
         if ((i & 31u) == 31u || i == numFiles - 1) {
-            printf("\r  %s: packed %u/%u", path_basename(directory), i + 1,
-                   numFiles);
-            fflush(stdout);
+            fprintf(log, "\r  %s: packed %u/%u", path_basename(directory),
+                    i + 1, numFiles);
+            fflush(log);
         }
     }
 
-    printf("\n");
+    fprintf(log, "\n");
 
-    // data begins immediately after the FAT
-    hdr.dataStart = (uint32_t)(hdr.headerSize + numFiles * sizeof(FATEntry));
+    if (autoCompressed || autoRaw)
+        fprintf(log, "  auto: %u compressed, %u stored raw (%u by estimate)\n",
+                autoCompressed, autoRaw, autoEstimated);
+
+    /*
+     * An "auto" entry rewritten raw over a larger compressed attempt can leave
+     * stale bytes past the last entry.
+     */
+    if (truncate_file(out, (long long)hdr.dataStart + (long long)offset) !=
+        EXIT_SUCCESS) {
+        fprintf(stderr, "build_acf: failed to truncate %s\n", outname);
+        goto error;
+    }
 
     // patch the header with the final dataStart value
     if (fseek(out, 0, SEEK_SET) != 0) {
@@ -699,14 +3061,21 @@ static int build_acf(const char *directory) {
         goto error;
     }
 
+    if (toStdout && copy_to_stdout(out) != EXIT_SUCCESS) {
+        fprintf(stderr, "build_acf: failed to write the archive to stdout\n");
+        goto error;
+    }
+
+    pipeline_destroy(&pipe);
     cleanup_build(out, fat, files, compressFlags, numFiles, jsonNames,
-                  jsonStates, jsonCount);
+                  jsonStates, jsonCount, enc);
 
     return EXIT_SUCCESS;
 
 error:
+    pipeline_destroy(&pipe); // its threads read files and write slots
     cleanup_build(out, fat, files, compressFlags, numFiles, jsonNames,
-                  jsonStates, jsonCount);
+                  jsonStates, jsonCount, enc);
     return EXIT_FAILURE;
 }
 
@@ -723,48 +3092,288 @@ int main(int argc, char **argv) {
                "Signs\n");
         printf("Copyright (c) 2026 SombrAbsol\n\n");
         printf("Usage:\n");
-        printf("  %s -x|--extract <in.acf|indir>  extract mode\n", argv[0]);
+        printf("  %s -x|--extract <in.acf|indir>  extract mode, - reads "
+               "stdin\n",
+               argv[0]);
         printf("  %s -b|--build   <indir>         build mode\n", argv[0]);
+        printf("  %s --check      <in.acf|indir>  check mode, writes a JSON "
+               "report\n",
+               argv[0]);
+        printf("  %s -l|--list    <in.acf|indir>  list mode, reads only the "
+               "FAT\n",
+               argv[0]);
         printf("  %s -h|--help                    show this help\n", argv[0]);
+        printf("\nBuild options:\n");
+        printf("  -o|--output <file|-> write the archive there instead of "
+               "<indir>.acf\n");
+        printf("  --level <1-9>        LZ10 compression effort (default: %d)\n",
+               LZ10_LEVEL_DEFAULT);
+        printf("  --optimal            minimum-size encoding, same as --level "
+               "%d\n",
+               LZ10_LEVEL_MAX);
+        printf("  --auto-margin <pct>  minimum saving for \"auto\" entries "
+               "(default: %d)\n",
+               DEFAULT_AUTO_MARGIN);
+        printf("\nExtract options:\n");
+        printf("  --only <list>        extract only these entries, for example "
+               "12,40-45\n");
+        printf("  --ext <ext>          extract only entries with this "
+               "extension\n");
+        printf("  --stdout             write the selected entries to stdout\n");
+        printf("  --incremental        only rewrite files whose content "
+               "changed\n");
+        printf("  --tar <file|->       write the files and filelist.json as "
+               "one tar stream\n");
+        printf("  --io-uring           write small files in batches through "
+               "io_uring (Linux)\n");
+        printf("\nList options:\n");
+        printf("  --json               print a JSON report instead of "
+               "tables\n");
+        printf("\nCommon options:\n");
+        printf("  -j|--jobs <n>        worker threads (default: number of "
+               "CPUs)\n");
+        printf("  -r|--recursive       with a directory, also process its "
+               "subdirectories\n");
         return EXIT_SUCCESS;
     }
 
-    if (argc != 3) {
+    const char *mode = NULL;
+    const char *path = NULL;
+    int level = -1;    // -1 = not given on the command line
+    unsigned jobs = 0; // 0 = not given on the command line
+    long margin = -1;  // -1 = not given on the command line
+    EntrySelection sel = {0};
+    int toStdout = 0;
+    int json = 0;
+    int incremental = 0;
+    int ioUring = 0;
+    const char *tarPath = NULL;
+    const char *outPath = NULL;
+    int recursive = 0;
+    int status = EXIT_FAILURE;
+
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+
+        if (!strcmp(arg, "-x") || !strcmp(arg, "--extract") ||
+            !strcmp(arg, "-b") || !strcmp(arg, "--build") ||
+            !strcmp(arg, "--check") || !strcmp(arg, "-l") ||
+            !strcmp(arg, "--list")) {
+            if (mode || i + 1 >= argc) {
+                fprintf(stderr, "Invalid arguments\n");
+                fprintf(stderr, "Try '%s --help' for more information.\n",
+                        argv[0]);
+                goto done;
+            }
+            mode = arg;
+            path = argv[++i];
+        } else if (!strcmp(arg, "--optimal")) {
+            level = LZ10_LEVEL_MAX;
+        } else if (!strcmp(arg, "--level")) {
+            char *end = NULL;
+            long value = i + 1 < argc ? strtol(argv[++i], &end, 10) : 0;
+            if (!end || *end != '\0' || value < LZ10_LEVEL_MIN ||
+                value > LZ10_LEVEL_MAX) {
+                fprintf(stderr, "Invalid level: expected %d to %d\n",
+                        LZ10_LEVEL_MIN, LZ10_LEVEL_MAX);
+                goto done;
+            }
+            level = (int)value;
+        } else if (!strcmp(arg, "-j") || !strcmp(arg, "--jobs")) {
+            char *end = NULL;
+            long value = i + 1 < argc ? strtol(argv[++i], &end, 10) : 0;
+            if (!end || *end != '\0' || value < 1 || value > 1024) {
+                fprintf(stderr, "Invalid number of jobs: expected 1 to 1024\n");
+                goto done;
+            }
+            jobs = (unsigned)value;
+        } else if (!strcmp(arg, "--only")) {
+            if (sel.ranges || i + 1 >= argc ||
+                parse_index_list(argv[++i], &sel) != EXIT_SUCCESS) {
+                fprintf(stderr, "Invalid entry list: expected indices or "
+                                "ranges such as 12,40-45\n");
+                goto done;
+            }
+        } else if (!strcmp(arg, "--ext")) {
+            if (i + 1 >= argc || argv[i + 1][0] == '\0') {
+                fprintf(stderr, "Invalid extension\n");
+                goto done;
+            }
+            sel.ext = argv[++i];
+        } else if (!strcmp(arg, "--stdout")) {
+            toStdout = 1;
+        } else if (!strcmp(arg, "--json")) {
+            json = 1;
+        } else if (!strcmp(arg, "--incremental")) {
+            incremental = 1;
+        } else if (!strcmp(arg, "--io-uring")) {
+            ioUring = 1;
+        } else if (!strcmp(arg, "-r") || !strcmp(arg, "--recursive")) {
+            recursive = 1;
+        } else if (!strcmp(arg, "--tar")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing tar output: expected a file or -\n");
+                goto done;
+            }
+            tarPath = argv[++i];
+        } else if (!strcmp(arg, "-o") || !strcmp(arg, "--output")) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Missing output: expected a file or -\n");
+                goto done;
+            }
+            outPath = argv[++i];
+        } else if (!strcmp(arg, "--auto-margin")) {
+            char *end = NULL;
+            margin = i + 1 < argc ? strtol(argv[++i], &end, 10) : -1;
+            if (!end || *end != '\0' || margin < 0 || margin > 100) {
+                fprintf(stderr, "Invalid margin: expected 0 to 100\n");
+                goto done;
+            }
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            fprintf(stderr, "Try '%s --help' for more information.\n",
+                    argv[0]);
+            goto done;
+        }
+    }
+
+    if (!mode) {
         fprintf(stderr, "Invalid arguments\n");
         fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
-        return EXIT_FAILURE;
+        goto done;
+    }
+
+    int selective = sel.ranges || sel.ext || toStdout;
+    if (selective && strcmp(mode, "-x") && strcmp(mode, "--extract")) {
+        fprintf(stderr, "--only, --ext and --stdout only apply to extract "
+                        "mode\n");
+        goto done;
+    }
+
+    if ((incremental || tarPath) &&
+        (selective || (strcmp(mode, "-x") && strcmp(mode, "--extract")))) {
+        fprintf(stderr, "--incremental and --tar only apply to full "
+                        "extractions\n");
+        goto done;
+    }
+
+    if (ioUring && (incremental || tarPath || selective ||
+                    (strcmp(mode, "-x") && strcmp(mode, "--extract")))) {
+        fprintf(stderr, "--io-uring only applies to full extractions into "
+                        "files, without --incremental\n");
+        goto done;
+    }
+
+    int buildMode = !strcmp(mode, "-b") || !strcmp(mode, "--build");
+    if (recursive && buildMode) {
+        fprintf(stderr, "-r only applies to extract, check and list modes\n");
+        goto done;
+    }
+
+    if (outPath && !buildMode) {
+        fprintf(stderr, "-o only applies to build mode\n");
+        goto done;
+    }
+
+    int listMode = !strcmp(mode, "-l") || !strcmp(mode, "--list");
+    if (json && !listMode) {
+        fprintf(stderr, "--json only applies to list mode\n");
+        goto done;
     }
 
-    const char *mode = argv[1];
-    const char *path = argv[2];
+    if (listMode || !strcmp(mode, "--check")) {
+        if (level != -1 || margin != -1) {
+            fprintf(stderr, "--level, --optimal and --auto-margin only apply "
+                            "to build mode\n");
+            goto done;
+        }
 
-    if (!strcmp(mode, "-x") || !strcmp(mode, "--extract")) {
         struct stat st;
         if (stat(path, &st) != 0) {
             fprintf(stderr, "Invalid path: '%s'\n", path);
-            return EXIT_FAILURE;
+            goto done;
+        }
+
+        if (listMode)
+            status = list_archives(path, S_ISDIR(st.st_mode), recursive,
+                                   jobs ? jobs : cpu_count(), json);
+        else
+            status = check_archives(path, S_ISDIR(st.st_mode), recursive,
+                                    jobs ? jobs : cpu_count());
+    } else if (!strcmp(mode, "-x") || !strcmp(mode, "--extract")) {
+        if (level != -1 || margin != -1) {
+            fprintf(stderr, "--level, --optimal and --auto-margin only apply "
+                            "to build mode\n");
+            goto done;
+        }
+
+        // an archive piped in is read whole, so only full extractions apply
+        if (!strcmp(path, "-")) {
+            if (selective || incremental) {
+                fprintf(stderr, "--only, --ext, --stdout and --incremental "
+                                "need an archive file, not stdin\n");
+                goto done;
+            }
+            if (tarPath)
+                status = extract_tar(path, tarPath);
+            else
+                status = extract_acf(path, jobs ? jobs : cpu_count(), 1, 0,
+                                     ioUring);
+            goto done;
+        }
+
+        struct stat st;
+        if (stat(path, &st) != 0) {
+            fprintf(stderr, "Invalid path: '%s'\n", path);
+            goto done;
+        }
+
+        if (selective) {
+            if (S_ISDIR(st.st_mode))
+                fprintf(stderr, "--only, --ext and --stdout need an archive, "
+                                "not a directory\n");
+            else
+                status = extract_selected(path, &sel, toStdout);
+            goto done;
+        }
+
+        if (tarPath) {
+            if (incremental || S_ISDIR(st.st_mode)) {
+                fprintf(stderr, "--tar needs an archive, and cannot be "
+                                "combined with --incremental\n");
+                goto done;
+            }
+            status = extract_tar(path, tarPath);
+            goto done;
         }
 
         if (S_ISDIR(st.st_mode)) {
-            printf("Extracting all ACFs in directory: %s\n", path);
-            process_directory(path);
+            printf("Extracting all ACFs %s directory: %s\n",
+                   recursive ? "under" : "in", path);
+            status = process_directory(path, recursive,
+                                       jobs ? jobs : cpu_count(), incremental,
+                                       ioUring);
         } else {
-            return extract_acf(path);
+            status = extract_acf(path, jobs ? jobs : cpu_count(), 1,
+                                 incremental, ioUring);
         }
-    } else if (!strcmp(mode, "-b") || !strcmp(mode, "--build")) {
+    } else {
         struct stat st;
         if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
             fprintf(stderr, "Invalid path: '%s'\n", path);
-            return EXIT_FAILURE;
+            goto done;
         }
 
-        printf("Building ACF from directory: %s\n", path);
-        return build_acf(path);
-    } else {
-        fprintf(stderr, "Unknown option: %s\n", mode);
-        fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
-        return EXIT_FAILURE;
+        // keep stdout clean when the archive is written there
+        fprintf(outPath && !strcmp(outPath, "-") ? stderr : stdout,
+                "Building ACF from directory: %s\n", path);
+        status =
+            build_acf(path, outPath, level != -1 ? level : LZ10_LEVEL_DEFAULT,
+                      jobs ? jobs : cpu_count(),
+                      margin != -1 ? (unsigned)margin : DEFAULT_AUTO_MARGIN);
     }
 
-    return EXIT_SUCCESS;
+done:
+    free(sel.ranges);
+    return status;
 }
@@ -0,0 +1,239 @@
+/*
+ * Portable threading helpers.
+ *
+ * SPDX-FileCopyrightText: 2026 SombrAbsol
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "thread.h"
+
+/*
+ * Mutex wrappers around CRITICAL_SECTION on Windows, or pthread_mutex_t
+ * otherwise.
+ */
+int mutex_init(Mutex *m) {
+#ifdef _WIN32
+    InitializeCriticalSection(m);
+    return 0;
+#else
+    return pthread_mutex_init(m, NULL);
+#endif
+}
+
+void mutex_lock(Mutex *m) {
+#ifdef _WIN32
+    EnterCriticalSection(m);
+#else
+    pthread_mutex_lock(m);
+#endif
+}
+
+void mutex_unlock(Mutex *m) {
+#ifdef _WIN32
+    LeaveCriticalSection(m);
+#else
+    pthread_mutex_unlock(m);
+#endif
+}
+
+void mutex_destroy(Mutex *m) {
+#ifdef _WIN32
+    DeleteCriticalSection(m);
+#else
+    pthread_mutex_destroy(m);
+#endif
+}
+
+/*
+ * Condition variable wrappers around CONDITION_VARIABLE on Windows, or
+ * pthread_cond_t otherwise.
+ */
+int cond_init(Cond *c) {
+#ifdef _WIN32
+    InitializeConditionVariable(c);
+    return 0;
+#else
+    return pthread_cond_init(c, NULL);
+#endif
+}
+
+void cond_wait(Cond *c, Mutex *m) {
+#ifdef _WIN32
+    SleepConditionVariableCS(c, m, INFINITE);
+#else
+    pthread_cond_wait(c, m);
+#endif
+}
+
+void cond_signal(Cond *c) {
+#ifdef _WIN32
+    WakeConditionVariable(c);
+#else
+    pthread_cond_signal(c);
+#endif
+}
+
+void cond_broadcast(Cond *c) {
+#ifdef _WIN32
+    WakeAllConditionVariable(c);
+#else
+    pthread_cond_broadcast(c);
+#endif
+}
+
+void cond_destroy(Cond *c) {
+#ifdef _WIN32
+    (void)c; // nothing to release
+#else
+    pthread_cond_destroy(c);
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI thread_main(LPVOID param) {
+    Thread *t = param;
+    t->fn(t->arg);
+    return 0;
+}
+#else
+static void *thread_main(void *param) {
+    Thread *t = param;
+    t->fn(t->arg);
+    return NULL;
+}
+#endif
+
+/*
+ * Start a thread running fn(arg).
+ */
+int thread_start(Thread *t, void (*fn)(void *arg), void *arg) {
+    t->fn = fn;
+    t->arg = arg;
+#ifdef _WIN32
+    t->handle = CreateThread(NULL, 0, thread_main, t, 0, NULL);
+    return t->handle ? 0 : -1;
+#else
+    return pthread_create(&t->id, NULL, thread_main, t) == 0 ? 0 : -1;
+#endif
+}
+
+/*
+ * Wait for a thread started with thread_start to return.
+ */
+void thread_join(Thread *t) {
+#ifdef _WIN32
+    WaitForSingleObject(t->handle, INFINITE);
+    CloseHandle(t->handle);
+#else
+    pthread_join(t->id, NULL);
+#endif
+}
+
+/*
+ * Return the number of online CPUs, or 1 if it cannot be determined.
+ */
+unsigned cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors ? (unsigned)si.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned)n : 1;
+#endif
+}
+
+/*
+ * State shared by the workers of a parallel_for call.
+ */
+typedef struct {
+    void (*fn)(void *arg, size_t index, unsigned worker);
+    void *arg;
+    size_t count;
+    size_t next; // next index to hand out
+    Mutex lock;  // protects next
+} ParallelJob;
+
+typedef struct {
+    ParallelJob *job;
+    unsigned worker;
+    Thread thread;
+} ParallelWorker;
+
+/*
+ * Worker loop: claim indices until none are left.
+ */
+static void run_worker(ParallelJob *job, unsigned worker) {
+    for (;;) {
+        mutex_lock(&job->lock);
+        size_t index = job->next;
+        if (index < job->count)
+            ++job->next;
+        mutex_unlock(&job->lock);
+
+        if (index >= job->count)
+            return;
+
+        job->fn(job->arg, index, worker);
+    }
+}
+
+static void worker_main(void *param) {
+    ParallelWorker *w = param;
+    run_worker(w->job, w->worker);
+}
+
+/*
+ * Call fn(arg, index, worker) for every index in [0, count), spreading the
+ * calls over up to numThreads threads.
+ */
+void parallel_for(unsigned numThreads, size_t count,
+                  void (*fn)(void *arg, size_t index, unsigned worker),
+                  void *arg) {
+    ParallelJob job;
+    job.fn = fn;
+    job.arg = arg;
+    job.count = count;
+    job.next = 0;
+
+    if (numThreads > count)
+        numThreads = (unsigned)count;
+
+    ParallelWorker *workers = NULL;
+    if (numThreads > 1)
+        workers = calloc(numThreads, sizeof(*workers));
+
+    if (!workers || mutex_init(&job.lock) != 0) {
+        // single-threaded fallback
+        free(workers);
+        for (size_t i = 0; i < count; ++i)
+            fn(arg, i, 0);
+        return;
+    }
+
+    // the calling thread acts as worker 0
+    unsigned started = 1;
+    for (; started < numThreads; ++started) {
+        workers[started].job = &job;
+        workers[started].worker = started;
+        if (thread_start(&workers[started].thread, worker_main,
+                         &workers[started]) != 0)
+            break;
+    }
+
+    run_worker(&job, 0);
+
+    for (unsigned t = 1; t < started; ++t)
+        thread_join(&workers[t].thread);
+
+    mutex_destroy(&job.lock);
+    free(workers);
+}
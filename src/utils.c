@@ -6,6 +6,10 @@
  * SPDX-License-Identifier: MIT
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE // copy_file_range
+#endif
+
 #include <ctype.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -15,7 +19,13 @@
 #include <sys/stat.h>
 #ifdef _WIN32
 #include <direct.h>
+#include <fcntl.h>
+#include <io.h>
 #define strcasecmp _stricmp
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #endif
 
 #include "utils.h"
@@ -140,6 +150,255 @@ error:
     return NULL;
 }
 
+/*
+ * Read a stream to its end, such as a pipe that cannot be sized up front,
+ * doubling the buffer as needed.
+ */
+uint8_t *read_stream(FILE *f, size_t *outSize) {
+    size_t size = 0, cap = 0x10000;
+    uint8_t *buf = malloc(cap);
+    if (!buf) {
+        fprintf(stderr, "read_stream: memory allocation failed\n");
+        return NULL;
+    }
+
+    for (;;) {
+        size += fread(buf + size, 1, cap - size, f);
+        if (size < cap)
+            break;
+
+        uint8_t *grown = cap <= SIZE_MAX / 2 ? realloc(buf, cap * 2) : NULL;
+        if (!grown) {
+            fprintf(stderr, "read_stream: memory allocation failed\n");
+            free(buf);
+            return NULL;
+        }
+        buf = grown;
+        cap *= 2;
+    }
+
+    if (ferror(f)) {
+        fprintf(stderr, "read_stream: read error\n");
+        free(buf);
+        return NULL;
+    }
+
+    *outSize = size;
+    return buf;
+}
+
+/*
+ * Map a file read-only with mmap where available. Fall back to read_file for
+ * empty files, non-regular files and platforms or filesystems without mmap.
+ * A path of "-" reads all of stdin into memory.
+ */
+int map_file(const char *path, MappedFile *m) {
+    m->data = NULL;
+    m->size = 0;
+    m->mapped = 0;
+    m->fd = -1;
+
+    if (!strcmp(path, "-")) {
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        uint8_t *buf = read_stream(stdin, &m->size);
+        if (!buf)
+            return EXIT_FAILURE;
+
+        m->data = buf;
+        return EXIT_SUCCESS;
+    }
+
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+            (unsigned long long)st.st_size <= SIZE_MAX) {
+            void *p =
+                mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                m->data = p;
+                m->size = (size_t)st.st_size;
+                m->mapped = 1;
+                m->fd = fd; // kept open for write_file_range
+                return EXIT_SUCCESS;
+            }
+        }
+        close(fd);
+    }
+#endif
+
+    uint8_t *buf = read_file(path, &m->size);
+    if (!buf)
+        return EXIT_FAILURE;
+
+    m->data = buf;
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Release a file mapped with map_file.
+ */
+void unmap_file(MappedFile *m) {
+#ifndef _WIN32
+    if (m->mapped) {
+        munmap((void *)m->data, m->size);
+        close(m->fd);
+        m->data = NULL;
+        m->fd = -1;
+        return;
+    }
+#endif
+    free((void *)m->data);
+    m->data = NULL;
+}
+
+/*
+ * Write 'size' bytes of a mapped file, starting at 'offset', to a new file. On
+ * Linux the bytes are copied inside the kernel with copy_file_range, without
+ * faulting the mapping in; the rest, or everything elsewhere, is written from
+ * the mapping.
+ */
+int write_file_range(const char *path, const MappedFile *src, size_t offset,
+                     size_t size) {
+    if (!path || offset > src->size || size > src->size - offset)
+        return EXIT_FAILURE;
+
+#ifdef __linux__
+    if (src->fd >= 0 && size > 0) {
+        int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (out < 0) {
+            fprintf(stderr, "write_file_range: cannot open '%s'\n", path);
+            return EXIT_FAILURE;
+        }
+
+        loff_t in = (loff_t)offset;
+        size_t done = 0;
+        while (done < size) {
+            ssize_t n =
+                copy_file_range(src->fd, &in, out, NULL, size - done, 0);
+            if (n <= 0)
+                break; // unsupported here; finish with plain writes
+            done += (size_t)n;
+        }
+
+        while (done < size) {
+            ssize_t n = write(out, src->data + offset + done, size - done);
+            if (n < 0) {
+                close(out);
+                return EXIT_FAILURE;
+            }
+            done += (size_t)n;
+        }
+
+        return close(out) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+#endif
+
+    return write_file(path, src->data + offset, size);
+}
+
+/*
+ * Get the size of an open file and seek back to its start. Return -1 on
+ * failure.
+ */
+long long file_size(FILE *f) {
+    if (fseek(f, 0, SEEK_END) != 0)
+        return -1;
+
+#if defined(_WIN32)
+    long long sz = _ftelli64(f);
+#else
+    long long sz = ftello(f);
+#endif
+
+    rewind(f);
+    return sz;
+}
+
+/*
+ * Read exactly 'size' bytes at 'offset' of an open file, with pread where
+ * available so that concurrent readers do not share a file position.
+ */
+int read_file_at(FILE *f, long long offset, void *buf, size_t size) {
+#ifdef _WIN32
+    if (_fseeki64(f, offset, SEEK_SET) != 0 || fread(buf, 1, size, f) != size)
+        return EXIT_FAILURE;
+#else
+    uint8_t *p = buf;
+    while (size > 0) {
+        ssize_t n = pread(fileno(f), p, size, (off_t)offset);
+        if (n <= 0)
+            return EXIT_FAILURE;
+        p += n;
+        offset += n;
+        size -= (size_t)n;
+    }
+#endif
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * 64-bit FNV-1a hash, continued from 'h'. Feeding the data in pieces gives the
+ * same result as feeding it at once.
+ */
+uint64_t hash64(uint64_t h, const void *data, size_t size) {
+    const uint8_t *p = data;
+    for (size_t i = 0; i < size; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/*
+ * Check whether a file exists with exactly 'size' bytes hashing to 'hash' with
+ * hash64. The size is compared first, so a mismatch usually costs no read.
+ */
+int file_matches(const char *path, unsigned long long size, uint64_t hash) {
+    struct stat st;
+    if (stat(path, &st) != 0 || (unsigned long long)st.st_size != size)
+        return 0;
+
+    FILE *f = xfopen(path, "rb");
+    uint8_t *buf = malloc(0x10000);
+    int match = 0;
+
+    if (f && buf) {
+        uint64_t h = HASH64_INIT;
+        size_t n;
+        while ((n = fread(buf, 1, 0x10000, f)) > 0)
+            h = hash64(h, buf, n);
+        match = !ferror(f) && h == hash;
+    }
+
+    if (f)
+        fclose(f);
+    free(buf);
+    return match;
+}
+
+/*
+ * Cut an open file down to 'size' bytes, after flushing pending writes.
+ */
+int truncate_file(FILE *f, long long size) {
+    if (fflush(f) != 0)
+        return EXIT_FAILURE;
+
+#ifdef _WIN32
+    if (_chsize_s(_fileno(f), size) != 0)
+        return EXIT_FAILURE;
+#else
+    if (ftruncate(fileno(f), (off_t)size) != 0)
+        return EXIT_FAILURE;
+#endif
+
+    return EXIT_SUCCESS;
+}
+
 /*
  * Write bytes to a file, creating or truncating it as needed.
  */
@@ -328,7 +587,7 @@ static void skip_ws(const char **p) {
 
 /*
  * Parse a flat JSON object, mapping the literals true, false, and null to
- * the integers 1, 0, and -1 respectively.
+ * the integers 1, 0, and -1 respectively, and the string "auto" to 2.
  */
 int read_json_file_states(const char *path, char ***outNames, int **outStates,
                           uint32_t *outCount) {
@@ -427,9 +686,12 @@ int read_json_file_states(const char *path, char ***outNames, int **outStates,
         } else if (strncmp(p, "true", 4) == 0) {
             state = 1;
             p += 4;
+        } else if (strncmp(p, "\"auto\"", 6) == 0) {
+            state = 2;
+            p += 6;
         } else {
-            fprintf(stderr, "read_json_file_states: expected true, false, or "
-                            "null as value\n");
+            fprintf(stderr, "read_json_file_states: expected true, false, "
+                            "null, or \"auto\" as value\n");
             free(name);
             goto error;
         }
@@ -496,31 +758,23 @@ error:
 }
 
 /*
- * Write a flat JSON object, mapping the literals true, false, and null to the
- * integers 1, 0, and -1 respectively.
+ * Write a flat JSON object, mapping the integers 1, 0, -1, and 2 to the
+ * literals true, false, null, and the string "auto" respectively.
  */
-int write_json_file_states(const char *path, char *const *names,
-                           const int *states, uint32_t count) {
-    if (!path || (!names && count) || (!states && count))
-        return EXIT_FAILURE;
-
-    FILE *f = xfopen(path, "wb");
-    if (!f)
+int write_json_states(FILE *f, char *const *names, const int *states,
+                      uint32_t count) {
+    if ((!names && count) || (!states && count))
         return EXIT_FAILURE;
 
     fputs("{\n", f);
 
     for (uint32_t i = 0; i < count; ++i) {
-        if (!names[i]) {
-            fclose(f);
+        if (!names[i])
             return EXIT_FAILURE;
-        }
 
         char *esc = escape_json_string(names[i], strlen(names[i]));
-        if (!esc) {
-            fclose(f);
+        if (!esc)
             return EXIT_FAILURE;
-        }
 
         // map integer state back to its JSON literal
         const char *value = NULL;
@@ -530,9 +784,10 @@ int write_json_file_states(const char *path, char *const *names,
             value = "false";
         else if (states[i] == 1)
             value = "true";
+        else if (states[i] == 2)
+            value = "\"auto\"";
         else {
             free(esc);
-            fclose(f);
             return EXIT_FAILURE;
         }
 
@@ -543,8 +798,25 @@ int write_json_file_states(const char *path, char *const *names,
     }
 
     fputs("}\n", f);
+    return ferror(f) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Write the JSON object of write_json_states to a file, creating or truncating
+ * it.
+ */
+int write_json_file_states(const char *path, char *const *names,
+                           const int *states, uint32_t count) {
+    if (!path)
+        return EXIT_FAILURE;
+
+    FILE *f = xfopen(path, "wb");
+    if (!f)
+        return EXIT_FAILURE;
+
+    int status = write_json_states(f, names, states, count);
     fclose(f);
-    return EXIT_SUCCESS;
+    return status;
 }
 
 /*
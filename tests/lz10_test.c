@@ -0,0 +1,402 @@
+/*
+ * LZ10 codec tests, run by 'make check': round trips at every level, one-shot
+ * against streaming and single- against multi-threaded output, and damaged
+ * streams.
+ *
+ * SPDX-FileCopyrightText: 2026 SombrAbsol
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz10.h"
+
+/*
+ * One input of the fixed corpus.
+ */
+typedef struct {
+    const char *name;
+    uint8_t *data;
+    size_t size;
+} Sample;
+
+/*
+ * Growable buffer filled by the incremental encoder and decoder.
+ */
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t cap;
+} Buffer;
+
+static int failed; // a check of the current test failed
+
+/*
+ * Report a failed check.
+ */
+static void fail(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    printf("  ");
+    vprintf(fmt, ap);
+    printf("\n");
+    va_end(ap);
+    failed = 1;
+}
+
+/*
+ * Print the outcome of a test and reset the failure flag for the next one.
+ */
+static int report(const char *name) {
+    printf("%s %s\n", failed ? "FAIL" : "PASS", name);
+    int status = failed;
+    failed = 0;
+    return status;
+}
+
+/*
+ * Deterministic pseudo-random numbers, so that the corpus never changes.
+ */
+static uint32_t next_random(uint32_t *state) {
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 8;
+}
+
+/*
+ * Text-like data: words drawn from a small vocabulary, with some numbers.
+ */
+static void fill_text(uint8_t *dst, size_t size, uint32_t seed) {
+    static const char *const words[] = {
+        "ranger", "capture", "styler", "pokemon", "guardian", "signs",
+        "mission", "partner", "the", "a",      "of",      "and",
+        "quest",  "almia",   "oblivia", "to",    "with",    "union"};
+    size_t numWords = sizeof(words) / sizeof(words[0]);
+
+    size_t pos = 0;
+    while (pos < size) {
+        char piece[32];
+        uint32_t r = next_random(&seed);
+        int len = r % 11 == 0 ? snprintf(piece, sizeof(piece), "%u ", r % 997)
+                              : snprintf(piece, sizeof(piece), "%s%s",
+                                         words[r % numWords],
+                                         r % 7 == 0 ? ".\n" : " ");
+        for (int i = 0; i < len && pos < size; ++i)
+            dst[pos++] = (uint8_t)piece[i];
+    }
+}
+
+/*
+ * Binary-like data: runs, short repeating patterns that exercise overlapping
+ * copies, and stretches of noise.
+ */
+static void fill_binary(uint8_t *dst, size_t size, uint32_t seed) {
+    size_t pos = 0;
+    while (pos < size) {
+        uint32_t r = next_random(&seed);
+        size_t len = 16 + r % 300;
+        size_t period = 1 + (r >> 9) % 12;
+        int noise = (r >> 4) % 5 == 0;
+
+        for (size_t i = 0; i < len && pos < size; ++i, ++pos)
+            dst[pos] = noise ? (uint8_t)next_random(&seed)
+                             : (i < period ? (uint8_t)next_random(&seed)
+                                           : dst[pos - period]);
+    }
+}
+
+/*
+ * Incompressible data.
+ */
+static void fill_noise(uint8_t *dst, size_t size, uint32_t seed) {
+    for (size_t i = 0; i < size; ++i)
+        dst[i] = (uint8_t)next_random(&seed);
+}
+
+/*
+ * Build the corpus. The last sample spans two 512 KiB chunks.
+ */
+static int make_corpus(Sample *s, size_t count) {
+    static const size_t sizes[] = {1, 3, 40000, 20000, 8192, 0x80000 + 0x9000};
+    static const char *const names[] = {"byte",  "short", "text",
+                                        "binary", "noise", "large"};
+    if (count != sizeof(sizes) / sizeof(sizes[0]))
+        return -1;
+
+    for (size_t i = 0; i < count; ++i) {
+        s[i].name = names[i];
+        s[i].size = sizes[i];
+        s[i].data = malloc(sizes[i]);
+        if (!s[i].data)
+            return -1;
+    }
+
+    s[0].data[0] = 'x';
+    memcpy(s[1].data, "abc", 3);
+    fill_text(s[2].data, s[2].size, 1);
+    fill_binary(s[3].data, s[3].size, 2);
+    fill_noise(s[4].data, s[4].size, 3);
+
+    // text, then binary data, then text again referring back across chunks
+    size_t third = s[5].size / 3;
+    fill_text(s[5].data, third, 4);
+    fill_binary(s[5].data + third, third, 5);
+    fill_text(s[5].data + 2 * third, s[5].size - 2 * third, 4);
+    return 0;
+}
+
+/*
+ * LZ10Sink appending to a Buffer.
+ */
+static int buffer_sink(void *user, const uint8_t *data, size_t size) {
+    Buffer *b = user;
+    if (b->size + size > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->size + size)
+            cap *= 2;
+        uint8_t *grown = realloc(b->data, cap);
+        if (!grown)
+            return -1;
+        b->data = grown;
+        b->cap = cap;
+    }
+
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+    return 0;
+}
+
+/*
+ * Size of the next piece when feeding a stream in uneven pieces.
+ */
+static size_t piece_size(size_t i) {
+    static const size_t pieces[] = {1, 7, 4096, 65537, 300, 0x80000 + 5};
+    return pieces[i % (sizeof(pieces) / sizeof(pieces[0]))];
+}
+
+/*
+ * Decompress with every decoder and compare the output with the original.
+ */
+static void check_decodes(const Sample *s, int level, const uint8_t *comp,
+                          size_t compSize) {
+    size_t size = 0;
+    uint8_t *out = lz10_decompress(comp, compSize, &size);
+    if (!out || size != s->size || memcmp(out, s->data, size) != 0)
+        fail("%s, level %d: lz10_decompress does not round-trip", s->name,
+             level);
+    free(out);
+
+    size = 0;
+    if (lz10_validate(comp, compSize, &size) != 0 || size != s->size)
+        fail("%s, level %d: lz10_validate rejects the stream", s->name, level);
+
+    out = malloc(s->size);
+    if (!out || lz10_decompress_into(comp, compSize, out, s->size, &size) ||
+        size != s->size || memcmp(out, s->data, size) != 0)
+        fail("%s, level %d: lz10_decompress_into does not round-trip",
+             s->name, level);
+    free(out);
+
+    Buffer b = {0};
+    LZ10Decoder *d = lz10_decoder_create();
+    int rc = !d || lz10_decoder_begin(d, buffer_sink, &b);
+    for (size_t pos = 0, i = 0; !rc && pos < compSize; ++i) {
+        size_t n = piece_size(i);
+        n = n < compSize - pos ? n : compSize - pos;
+        rc = lz10_decoder_feed(d, comp + pos, n);
+        pos += n;
+    }
+    if (rc || lz10_decoder_finish(d, &size) || size != s->size ||
+        b.size != s->size || memcmp(b.data, s->data, s->size) != 0)
+        fail("%s, level %d: LZ10Decoder does not round-trip", s->name, level);
+    lz10_decoder_destroy(d);
+    free(b.data);
+}
+
+/*
+ * Round-trip every sample at every level through every decoder.
+ */
+static int test_round_trip(const Sample *s, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        for (int level = LZ10_LEVEL_MIN; level <= LZ10_LEVEL_MAX; ++level) {
+            size_t compSize = 0;
+            uint8_t *comp =
+                lz10_compress_level(s[i].data, s[i].size, level, &compSize);
+            if (!comp) {
+                fail("%s, level %d: compression failed", s[i].name, level);
+                continue;
+            }
+            check_decodes(&s[i], level, comp, compSize);
+            free(comp);
+        }
+    }
+    return report("lz10 round trip at every level");
+}
+
+/*
+ * No level produces more bytes than the level below it.
+ */
+static int test_levels(const Sample *s, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        size_t prev = SIZE_MAX;
+        for (int level = LZ10_LEVEL_MIN; level <= LZ10_LEVEL_MAX; ++level) {
+            size_t size = 0;
+            free(lz10_compress_level(s[i].data, s[i].size, level, &size));
+            if (size > prev)
+                fail("%s: level %d gives %zu bytes, level %d gave %zu",
+                     s[i].name, level, size, level - 1, prev);
+            prev = size;
+        }
+    }
+    return report("lz10 levels never grow the output");
+}
+
+/*
+ * Encode a sample with the incremental encoder, fed in uneven pieces.
+ */
+static int stream_encode(const Sample *s, int level, unsigned threads,
+                         Buffer *b) {
+    LZ10Encoder *e = lz10_encoder_create(level, threads);
+    size_t size = 0;
+    int rc = !e || lz10_encoder_begin(e, s->size, buffer_sink, b);
+    for (size_t pos = 0, i = 0; !rc && pos < s->size; ++i) {
+        size_t n = piece_size(i);
+        n = n < s->size - pos ? n : s->size - pos;
+        rc = lz10_encoder_feed(e, s->data + pos, n);
+        pos += n;
+    }
+    rc = rc || lz10_encoder_finish(e, &size) || size != b->size;
+    lz10_encoder_destroy(e);
+    return rc;
+}
+
+/*
+ * The multi-threaded and incremental encoders produce the same bytes as the
+ * single-threaded one-shot encoder, whatever the number of threads.
+ */
+static int test_identity(const Sample *s, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        for (int level = LZ10_LEVEL_MIN; level <= LZ10_LEVEL_MAX; ++level) {
+            size_t size1 = 0, size4 = 0;
+            uint8_t *one = lz10_compress_mt(s[i].data, s[i].size, level, 1,
+                                            &size1);
+            uint8_t *four = lz10_compress_mt(s[i].data, s[i].size, level, 4,
+                                             &size4);
+            if (!one || !four || size1 != size4 || memcmp(one, four, size1))
+                fail("%s, level %d: -j 1 and -j 4 outputs differ", s[i].name,
+                     level);
+
+            for (unsigned threads = 1; one && threads <= 4; threads += 3) {
+                Buffer b = {0};
+                if (stream_encode(&s[i], level, threads, &b) ||
+                    b.size != size1 || memcmp(b.data, one, size1) != 0)
+                    fail("%s, level %d: streaming on %u threads differs from "
+                         "one-shot",
+                         s[i].name, level, threads);
+                free(b.data);
+            }
+
+            free(one);
+            free(four);
+        }
+    }
+    return report("lz10 one-shot, streaming and threaded outputs match");
+}
+
+/*
+ * Decode a damaged stream with every decoder. Return the number of decoders
+ * that accepted it, or -1 if their outputs or sizes disagree.
+ */
+static int decode_damaged(const uint8_t *comp, size_t compSize) {
+    size_t declared = lz10_peek_size(comp, compSize);
+    size_t validSize = 0, intoSize = 0, streamSize = 0;
+
+    int valid = lz10_validate(comp, compSize, &validSize) == 0;
+
+    uint8_t *into = malloc(declared ? declared : 1);
+    int intoOk = into && lz10_decompress_into(comp, compSize, into, declared,
+                                              &intoSize) == 0;
+
+    Buffer b = {0};
+    LZ10Decoder *d = lz10_decoder_create();
+    int streamOk = d && lz10_decoder_begin(d, buffer_sink, &b) == 0 &&
+                   lz10_decoder_feed(d, comp, compSize) == 0 &&
+                   lz10_decoder_finish(d, &streamSize) == 0;
+    lz10_decoder_destroy(d);
+
+    int agree = valid == intoOk && valid == streamOk &&
+                (!valid || (validSize == intoSize && intoSize == streamSize &&
+                            memcmp(into, b.data, intoSize) == 0));
+    free(into);
+    free(b.data);
+    return agree ? valid + intoOk + streamOk : -1;
+}
+
+/*
+ * Truncated streams are rejected by every decoder, and corrupted ones are
+ * either rejected or accepted by all of them alike, without crashing.
+ */
+static int test_damaged(const Sample *s) {
+    size_t compSize = 0;
+    uint8_t *comp = lz10_compress_level(s->data, s->size, 5, &compSize);
+    uint8_t *copy = malloc(compSize);
+    if (!comp || !copy) {
+        fail("%s: compression failed", s->name);
+        free(comp);
+        free(copy);
+        return report("lz10 decoders reject damaged streams");
+    }
+
+    for (size_t len = 0; len < compSize; len += len < 64 ? 1 : 97) {
+        memcpy(copy, comp, len);
+        if (decode_damaged(copy, len) != 0)
+            fail("%s: stream truncated to %zu bytes was accepted", s->name,
+                 len);
+    }
+
+    // a header declaring one byte more than the stream holds
+    memcpy(copy, comp, compSize);
+    size_t more = s->size + 1;
+    copy[1] = (uint8_t)more;
+    copy[2] = (uint8_t)(more >> 8);
+    copy[3] = (uint8_t)(more >> 16);
+    if (decode_damaged(copy, compSize) != 0)
+        fail("%s: stream declaring %zu bytes was accepted", s->name, more);
+
+    uint32_t seed = 6;
+    for (int i = 0; i < 2000; ++i) {
+        memcpy(copy, comp, compSize);
+        size_t pos = 4 + next_random(&seed) % (compSize - 4);
+        copy[pos] ^= (uint8_t)(1u << (next_random(&seed) % 8));
+        if (decode_damaged(copy, compSize) < 0)
+            fail("%s: decoders disagree on a flip at byte %zu", s->name, pos);
+    }
+
+    free(comp);
+    free(copy);
+    return report("lz10 decoders reject damaged streams");
+}
+
+int main(void) {
+    Sample corpus[6];
+    size_t count = sizeof(corpus) / sizeof(corpus[0]);
+    if (make_corpus(corpus, count) != 0) {
+        printf("FAIL lz10 corpus: memory allocation failed\n");
+        return EXIT_FAILURE;
+    }
+
+    int status = 0;
+    status |= test_round_trip(corpus, count);
+    status |= test_levels(corpus, count);
+    status |= test_identity(corpus, count);
+    status |= test_damaged(&corpus[2]);
+
+    for (size_t i = 0; i < count; ++i)
+        free(corpus[i].data);
+    return status ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,146 @@
+#!/bin/sh
+#
+# Regression tests for acftool, run by 'make check'.
+#
+# SPDX-FileCopyrightText: 2026 SombrAbsol
+#
+# SPDX-License-Identifier: MIT
+
+set -u
+
+ACFTOOL=${1:-build/acftool}
+LZ10TEST=${2:-build/lz10_test}
+DATA=$(dirname "$0")/data
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT INT TERM
+
+failed=0
+
+pass() {
+    printf 'PASS %s\n' "$1"
+}
+
+fail() {
+    printf 'FAIL %s\n' "$1"
+    failed=1
+}
+
+# empty entries hold no bytes, whether they share an offset or end the file
+if "$ACFTOOL" --check "$DATA/empty-entries.acf" >"$TMP/check.json"; then
+    pass "check accepts empty entries"
+else
+    fail "check accepts empty entries"
+    cat "$TMP/check.json"
+fi
+
+# a listing reports entries that do not decode without printing diagnostics
+if "$ACFTOOL" -l "$DATA/damaged-entry.acf" --json >"$TMP/list.json" \
+    2>"$TMP/list.err" && grep -q '"damaged"' "$TMP/list.json" &&
+    ! [ -s "$TMP/list.err" ]; then
+    pass "list marks damaged entries quietly"
+else
+    fail "list marks damaged entries quietly"
+    cat "$TMP/list.json" "$TMP/list.err"
+fi
+
+# a check reports a damaged entry in its JSON output only
+if ! "$ACFTOOL" --check "$DATA/damaged-entry.acf" >"$TMP/check-bad.json" \
+    2>"$TMP/check-bad.err" &&
+    grep -q '"invalid LZ10 stream"' "$TMP/check-bad.json" &&
+    ! [ -s "$TMP/check-bad.err" ]; then
+    pass "check fails damaged entries quietly"
+else
+    fail "check fails damaged entries quietly"
+    cat "$TMP/check-bad.json" "$TMP/check-bad.err"
+fi
+
+# an entry too large for the pipeline is streamed between pipelined ones, and
+# the archive does not depend on the number of threads
+mkdir "$TMP/mixed"
+printf '{\n' >"$TMP/mixed/filelist.json"
+i=0
+while [ $i -lt 12 ]; do
+    name=$(printf '%04d.bin' $i)
+    if [ $i -eq 5 ]; then
+        awk 'BEGIN { for (n = 0; n < 100000; ++n) print n * 7 }' \
+            >"$TMP/mixed/$name"
+    else
+        yes "entry $i" | head -c $((1000 * i + 100)) >"$TMP/mixed/$name"
+    fi
+    [ $i -gt 0 ] && printf ',\n' >>"$TMP/mixed/filelist.json"
+    state=true
+    [ $((i % 3)) -eq 2 ] && state='"auto"'
+    printf '  "%s": %s' "$name" "$state" >>"$TMP/mixed/filelist.json"
+    i=$((i + 1))
+done
+printf '\n}\n' >>"$TMP/mixed/filelist.json"
+
+if "$ACFTOOL" -b "$TMP/mixed" -o "$TMP/mixed1.acf" -j 1 >/dev/null &&
+    "$ACFTOOL" -b "$TMP/mixed" -o "$TMP/mixed4.acf" -j 4 >/dev/null &&
+    cmp -s "$TMP/mixed1.acf" "$TMP/mixed4.acf" &&
+    "$ACFTOOL" -x "$TMP/mixed4.acf" >/dev/null &&
+    "$ACFTOOL" -b "$TMP/mixed4" -o "$TMP/mixed-again.acf" -j 4 >/dev/null &&
+    cmp -s "$TMP/mixed4.acf" "$TMP/mixed-again.acf"; then
+    # extracted files are named after the magic of their contents
+    roundtrip=1
+    for f in "$TMP/mixed"/*.bin; do
+        name=${f##*/}
+        set -- "$TMP/mixed4/${name%.bin}".*
+        cmp -s "$f" "$1" || roundtrip=0
+    done
+    if [ $roundtrip -eq 1 ]; then
+        pass "build streams large entries alike on any number of threads"
+    else
+        fail "build streams large entries alike on any number of threads"
+    fi
+else
+    fail "build streams large entries alike on any number of threads"
+fi
+
+# batched extraction writes the same files as the default one
+mkdir "$TMP/ring" "$TMP/plain"
+cp "$TMP/mixed1.acf" "$TMP/ring/a.acf"
+cp "$TMP/mixed1.acf" "$TMP/plain/a.acf"
+if "$ACFTOOL" -x "$TMP/ring/a.acf" --io-uring >/dev/null &&
+    "$ACFTOOL" -x "$TMP/plain/a.acf" >/dev/null &&
+    diff -r "$TMP/ring/a" "$TMP/plain/a" >/dev/null; then
+    pass "io_uring extraction matches the default one"
+else
+    fail "io_uring extraction matches the default one"
+fi
+
+# a build still completes when its pipeline gets a reader but no worker
+if [ "$(uname -s)" = Linux ] &&
+    ${CC:-cc} -shared -fPIC -o "$TMP/zero_workers.so" \
+        "$(dirname "$0")/zero_workers.c" -ldl; then
+    mkdir "$TMP/pipe"
+    printf '{\n' >"$TMP/pipe/filelist.json"
+    i=0
+    while [ $i -lt 400 ]; do
+        name=$(printf '%04d.bin' $i)
+        yes "entry $i" | head -c 8192 >"$TMP/pipe/$name"
+        [ $i -gt 0 ] && printf ',\n' >>"$TMP/pipe/filelist.json"
+        printf '  "%s": true' "$name" >>"$TMP/pipe/filelist.json"
+        i=$((i + 1))
+    done
+    printf '\n}\n' >>"$TMP/pipe/filelist.json"
+
+    # packing at level 9 is slower than reading, so the reader leads
+    "$ACFTOOL" -b "$TMP/pipe" -o "$TMP/pipe1.acf" --level 9 -j 1 >/dev/null
+    if ACFTEST_SLOW_FILE=/0200.bin LD_PRELOAD="$TMP/zero_workers.so" \
+        timeout 30 "$ACFTOOL" -b "$TMP/pipe" -o "$TMP/pipe4.acf" \
+        --level 9 -j 4 >/dev/null &&
+        cmp -s "$TMP/pipe1.acf" "$TMP/pipe4.acf"; then
+        pass "build completes without pipeline workers"
+    else
+        fail "build completes without pipeline workers"
+    fi
+else
+    printf 'SKIP build completes without pipeline workers\n'
+fi
+
+# the codec round-trips, encodes alike on any number of threads and rejects
+# damaged streams; the decoders' own diagnostics are not part of the output
+"$LZ10TEST" 2>/dev/null || failed=1
+
+exit $failed
@@ -0,0 +1,59 @@
+/*
+ * LD_PRELOAD shim for tests/run.sh: only the first thread of the process
+ * starts, and opening the file named by ACFTEST_SLOW_FILE takes a moment.
+ * A build then runs its pipeline with a reader and no compression worker,
+ * while the writer waits on the slow entry.
+ *
+ * SPDX-FileCopyrightText: 2026 SombrAbsol
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef int (*CreateFn)(pthread_t *, const pthread_attr_t *,
+                        void *(*)(void *), void *);
+typedef FILE *(*OpenFn)(const char *, const char *);
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                   void *(*fn)(void *), void *arg) {
+    static int started;
+    if (__atomic_fetch_add(&started, 1, __ATOMIC_RELAXED) > 0)
+        return EAGAIN;
+
+    CreateFn real = (CreateFn)dlsym(RTLD_NEXT, "pthread_create");
+    return real(thread, attr, fn, arg);
+}
+
+/*
+ * Sleep for a quarter of a second if path ends with ACFTEST_SLOW_FILE.
+ */
+static void maybe_stall(const char *path) {
+    const char *slow = getenv("ACFTEST_SLOW_FILE");
+    size_t len = slow ? strlen(slow) : 0;
+    size_t pathLen = strlen(path);
+    if (!len || pathLen < len || strcmp(path + pathLen - len, slow) != 0)
+        return;
+
+    struct timespec delay = {0, 250000000};
+    nanosleep(&delay, NULL);
+}
+
+FILE *fopen(const char *path, const char *mode) {
+    maybe_stall(path);
+    OpenFn real = (OpenFn)dlsym(RTLD_NEXT, "fopen");
+    return real(path, mode);
+}
+
+FILE *fopen64(const char *path, const char *mode) {
+    maybe_stall(path);
+    OpenFn real = (OpenFn)dlsym(RTLD_NEXT, "fopen64");
+    return real(path, mode);
+}